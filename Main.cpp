@@ -1,7 +1,12 @@
 #include "Graphics/graphics.h"
+#ifdef _WIN32
 #pragma comment(lib, "Gdiplus.lib")
+#endif
 
 Grfx::Graphics console_graphics;
+Grfx::SpriteCache sprite_cache;
+// Off while a batch runs: shapes keep their state but nothing is drawn
+bool rendering = true;
 
 const char MENU = 'q';
 
@@ -12,9 +17,12 @@ const char SaveToFile = 'f';
 const char ReadFromFile = 'l';
 
 const char ChangeObject = 'o';
+const char GroupObjects = 'u';
+const char UngroupObject = 'y';
 const char AddObject = 'g';
 const char ChangeColor = 'r';
 const char ChangeSize = 'm';
+const char Rotate = 'e';
 const char Hideobject = 'h';
 const char Showobject = 'j';
 
@@ -23,430 +31,1347 @@ const char ScreenSize = 'v';
 
 const char ShapeTrail = 't';
 
+const char Collisions = 'k';
+
 const char UP = 'w';
 const char DOWN = 's';
 const char LEFT = 'a';
 const char RIGHT = 'd';
 
-const int  BGCOLOR = 0;
+// Shift with the movement keys pans the view over the canvas
+const char PAN_UP = 'W';
+const char PAN_DOWN = 'S';
+const char PAN_LEFT = 'A';
+const char PAN_RIGHT = 'D';
+
+const int  BGCOLOR = Grfx::ERASE;
 const int  COLOR = 2;
 const int  STEP = 10;
-
-class Shape
+const int  FRAME = 30;     // ms per frame of scripted motion
+const int  TURN_STEP = 15; // degrees per key press
+const int  CANVAS = 100000; // side of the canvas the window looks at
+const int  PAN = 100;       // pixels per pan key press
+
+// Trail points of all shapes. Consecutive points usually differ by exactly
+// one STEP along an axis and are stored as 2-bit direction codes, other
+// moves as 16-bit deltas. Points live in fixed-size chunks; when the memory
+// budget is exceeded the oldest chunk of any trail is dropped and its pixels
+// are erased from the trails layer; repaint() draws the trails still shown
+// there again.
+class TrailStore
 {
-protected:
-    int x, y, color, size;
-    bool drawTrail = false;
-
-    void drawPixel(int x, int y, int c) {
-        console_graphics.setcolor(c);
-        console_graphics.rectangle(x, y, x + 1, y + 1);
-    }
-
-public:
-    Shape(int a, int b, int c) : x(a), y(b), color(c), size(1), drawTrail(false) {}
-
-    virtual ~Shape() {};
-    virtual void draw(int c) = 0;
-    virtual void move(int dx, int dy) = 0;
-    virtual void setColor(int c) { color = c; }
-    virtual void setSize(int s) { size = s; }
-    virtual int getSize() { return size; }
-    virtual void resize(int delta) { size += delta; }
+    static const int CHUNK_BYTES = 256;
+    static const int RUN = 16;  // steps in a row that end a chunk of deltas
 
-    void show() { draw(color); }
-    void hide() { draw(BGCOLOR); }
-    void SetTrail(bool value) { drawTrail = value; }
-    void toggleTrail() { drawTrail = !drawTrail; }
-
-    int getX() { return this->x; }
-    int getY() { return this->y; }
-    int getColor() { return this->color; }
-    bool getDrawTrail() { return this->drawTrail; }
+    enum Encoding : unsigned char { NONE, DIRECTIONS, DELTAS };
 
-    virtual std::string getType() const {
-        return "Shape";
+    struct Chunk
+    {
+        int trail;
+        int x, y;               // first point
+        int lastX, lastY;       // last point, the next one is encoded relative to it
+        unsigned short count;   // encoded points after the first
+        unsigned short run;     // steps at the end
+        Encoding encoding;
+        int left, top, right, bottom;   // bounds of the points
+        unsigned char data[CHUNK_BYTES];
+    };
+
+    int step;
+    size_t limit;
+    std::list<Chunk> chunks;    // chunks of all trails, oldest first
+    std::vector<std::deque<std::list<Chunk>::iterator>> trails;
+    std::vector<int> freeIds;
+    std::vector<int> colors;    // per trail, BGCOLOR while not shown
+    // area erased by evictions since the last repaint()
+    int damageLeft = INT_MAX, damageTop = INT_MAX, damageRight = INT_MIN, damageBottom = INT_MIN;
+
+    int direction(int dx, int dy) const {
+        if (dx == 0 && dy == -step) return 0;       // same codes as trajectory()
+        if (dx == 0 && dy == step) return 1;
+        if (dx == -step && dy == 0) return 2;
+        if (dx == step && dy == 0) return 3;
+        return -1;
     }
-};
 
-class Segment : public Shape
-{
-    int dx, dy;
-    std::vector<std::pair<int, int>> trail;
+    bool encode(Chunk& chunk, int x, int y) {
+        int dx = x - chunk.lastX, dy = y - chunk.lastY;
+        int code = direction(dx, dy);
 
-public:
-    Segment(int a, int b, int da, int db, int c) : Shape(a, b, c), dx(da), dy(db) { show(); }
+        if (chunk.encoding == NONE) chunk.encoding = code >= 0 ? DIRECTIONS : DELTAS;
 
-    void draw(int c) override {
-        console_graphics.setcolor(c);
-        console_graphics.line(x, y, x + dx, y + dy);
+        if (chunk.encoding == DIRECTIONS) {
+            if (code < 0 || chunk.count == CHUNK_BYTES * 4) return false;
+            chunk.data[chunk.count / 4] |= code << (2 * (chunk.count % 4));
+        }
+        else {
+            // a long run of steps goes on in a chunk of directions
+            if (code >= 0 && chunk.run >= RUN) return false;
+            if (dx < INT16_MIN || dx > INT16_MAX || dy < INT16_MIN || dy > INT16_MAX) return false;
+            if (chunk.count == CHUNK_BYTES / 4) return false;
+            int16_t delta[2] = { int16_t(dx), int16_t(dy) };
+            memcpy(&chunk.data[chunk.count * 4], delta, sizeof(delta));
+        }
+        chunk.count++;
+        chunk.run = code >= 0 ? chunk.run + 1 : 0;
+        chunk.lastX = x;
+        chunk.lastY = y;
+        chunk.left = (std::min)(chunk.left, x);
+        chunk.top = (std::min)(chunk.top, y);
+        chunk.right = (std::max)(chunk.right, x);
+        chunk.bottom = (std::max)(chunk.bottom, y);
+        return true;
+    }
 
-        if (drawTrail) {
-            for (const auto& point : trail) {
-                drawPixel(point.first, point.second, c);
+    template <class F>
+    void decode(const Chunk& chunk, F f) const {
+        int x = chunk.x, y = chunk.y;
+        f(x, y);
+        for (int i = 0; i < chunk.count; i++) {
+            if (chunk.encoding == DIRECTIONS) {
+                switch ((chunk.data[i / 4] >> (2 * (i % 4))) & 3) {
+                case 0: y -= step; break;
+                case 1: y += step; break;
+                case 2: x -= step; break;
+                case 3: x += step; break;
+                }
+            }
+            else {
+                int16_t delta[2];
+                memcpy(delta, &chunk.data[i * 4], sizeof(delta));
+                x += delta[0];
+                y += delta[1];
             }
+            f(x, y);
         }
     }
 
-    int getSize() override {
-        return this->dx;
+    void erasePixels(const Chunk& chunk);
+
+    void evict() {
+        while (size() > limit && !chunks.empty()) {
+            Chunk oldest = chunks.front();
+            trails[oldest.trail].pop_front();
+            chunks.pop_front();
+            erasePixels(oldest);
+        }
     }
 
-    
-    void resize(int delta) override {
-        dx += delta;
-        dy += delta;
+    void drop(std::deque<std::list<Chunk>::iterator>& trail) {
+        for (auto chunk : trail) chunks.erase(chunk);
+        trail.clear();
     }
 
-    void setColor(int c) override {
-        color = c;
+public:
+    TrailStore(int s, size_t budget = 4 * 1024 * 1024) : step(s), limit(budget) {}
+
+    int create() {
+        if (!freeIds.empty()) {
+            int id = freeIds.back();
+            freeIds.pop_back();
+            colors[id] = BGCOLOR;
+            return id;
+        }
+        trails.emplace_back();
+        colors.push_back(BGCOLOR);
+        return int(trails.size() - 1);
     }
 
-    void move(int dx, int dy) override {
-        hide();
+    void release(int id) {
+        drop(trails[id]);
+        freeIds.push_back(id);
+    }
 
-        if (drawTrail) {
-            trail.push_back(std::make_pair(x, y));
+    // Colour the trail is shown in on the trails layer, BGCOLOR if it is not
+    void setColor(int id, int c) { colors[id] = c; }
+
+    // Draws the shown trails again where evicted chunks were erased; once
+    // per frame, as scanning the chunks costs the same for one eviction or many
+    void repaint();
+
+    void append(int id, int x, int y) {
+        auto& trail = trails[id];
+        Encoding encoding = NONE;
+        if (!trail.empty()) {
+            Chunk& last = *trail.back();
+            if (encode(last, x, y)) return;
+            // moves that are not one step stay in deltas until the steps
+            // are back for a while, so a mixed run does not start a chunk
+            // every other point
+            if (direction(x - last.lastX, y - last.lastY) < 0 || (last.encoding == DELTAS && last.run < RUN)) encoding = DELTAS;
         }
 
-        x += dx;
-        y += dy;
+        chunks.emplace_back();
+        Chunk& chunk = chunks.back();
+        chunk.trail = id;
+        chunk.x = chunk.lastX = chunk.left = chunk.right = x;
+        chunk.y = chunk.lastY = chunk.top = chunk.bottom = y;
+        chunk.count = 0;
+        chunk.run = 0;
+        chunk.encoding = encoding;
+        memset(chunk.data, 0, sizeof(chunk.data));
+        trail.push_back(std::prev(chunks.end()));
+        evict();
+    }
 
-        show();
+    void clear(int id) { drop(trails[id]); }
+
+    void clear() {
+        chunks.clear();
+        for (auto& trail : trails) trail.clear();
     }
 
-    void setSize(int s) override {
-        double ratio = static_cast<double>(s) / getSize();
-        dx = static_cast<int>(dx * ratio);
-        dy = static_cast<int>(dy * ratio);
+    // Calls f(x, y) for every point of the trail, oldest first
+    template <class F>
+    void forEach(int id, F f) const {
+        for (auto chunk : trails[id]) decode(*chunk, f);
     }
 
-    std::string getType() const override {
-        return "Segment";
+    void setBudget(size_t bytes) {
+        limit = bytes;
+        evict();
     }
+
+    size_t budget() const { return limit; }
+    size_t size() const { return chunks.size() * sizeof(Chunk); }
 };
 
-class Star : public Shape
+TrailStore trail_store(STEP);
+
+class Shape;
+
+// Axis-aligned bounding box, edges inclusive
+struct Box
 {
-    int innerRadius;
-    int outerRadius;
-    std::vector<std::pair<int, int>> trail; // Trail coordinates
+    int left, top, right, bottom;
+};
 
-public:
-    Star(int a, int b, int inner, int outer, int c) : Shape(a, b, c), innerRadius(inner), outerRadius(outer) { show(); }
+// Exact geometry for the narrow phase; closed shapes count as filled
+struct Collider
+{
+    enum Kind { SEGMENT, CIRCLE, POLYGON } kind;
+    int cx, cy, r;              // CIRCLE
+    Grfx::Point pts[10];        // SEGMENT (2 points) or POLYGON, nonzero winding
+    int n;
+};
 
-    void setColor(int c) override {
-        color = c;
+// Broad phase: boxes kept sorted by their left edge, so pairs overlapping
+// along x are found by one sweep. Shapes move by small steps, so an update
+// moves its entry by a few places to keep the order; after adding or
+// removing shapes everything is sorted again before the next query.
+class SweepAndPrune
+{
+    struct Entry
+    {
+        Shape* shape;
+        int id;
+    };
+
+    // parallel arrays in sweep order, boxes split up for the tight sweep loop
+    std::vector<Entry> entries;
+    std::vector<int> lefts, tops, rights, bottoms;
+    std::vector<int> slot;      // body id -> index in the arrays
+    std::vector<int> freeIds;
+    bool unsorted = false;
+    int maxWidth = 0;           // no box is wider, bounds searches to the left
+
+    void swapEntries(size_t i, size_t j) {
+        std::swap(entries[i], entries[j]);
+        std::swap(lefts[i], lefts[j]);
+        std::swap(tops[i], tops[j]);
+        std::swap(rights[i], rights[j]);
+        std::swap(bottoms[i], bottoms[j]);
+        slot[entries[i].id] = int(i);
+        slot[entries[j].id] = int(j);
     }
 
-    int getSize() override {
-        return innerRadius;
+    void sort() {
+        if (!unsorted) return;
+        std::vector<size_t> order(entries.size());
+        for (size_t i = 0; i < order.size(); i++) order[i] = i;
+        std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return lefts[a] < lefts[b]; });
+
+        std::vector<Entry> sortedEntries(entries.size());
+        std::vector<int> l(order.size()), t(order.size()), r(order.size()), b(order.size());
+        maxWidth = 0;
+        for (size_t i = 0; i < order.size(); i++) {
+            sortedEntries[i] = entries[order[i]];
+            l[i] = lefts[order[i]];
+            t[i] = tops[order[i]];
+            r[i] = rights[order[i]];
+            b[i] = bottoms[order[i]];
+            slot[sortedEntries[i].id] = int(i);
+            if (r[i] >= l[i]) maxWidth = (std::max)(maxWidth, r[i] - l[i]);
+        }
+        entries.swap(sortedEntries);
+        lefts.swap(l);
+        tops.swap(t);
+        rights.swap(r);
+        bottoms.swap(b);
+        unsorted = false;
     }
 
-    void resize(int delta) override {
-        innerRadius += delta;
-        outerRadius += delta;
+public:
+    int add(Shape* shape) {
+        int id;
+        if (!freeIds.empty()) {
+            id = freeIds.back();
+            freeIds.pop_back();
+        }
+        else {
+            id = int(slot.size());
+            slot.push_back(0);
+        }
+        slot[id] = int(entries.size());
+        entries.push_back({ shape, id });
+        lefts.push_back(INT_MAX);
+        tops.push_back(INT_MAX);
+        rights.push_back(INT_MIN);
+        bottoms.push_back(INT_MIN);
+        unsorted = true;
+        return id;
     }
 
-    void draw(int c) override {
-        console_graphics.setcolor(c);
-
-        // Draw the star using lines
-        for (int i = 0; i < 360; i += 36) {
-            double angle1 = i * M_PI / 180;
-            double angle2 = (i + 36) * M_PI / 180;
-
-            int x1 = static_cast<int>(x + outerRadius * cos(angle1));
-            int y1 = static_cast<int>(y + outerRadius * sin(angle1));
+    void remove(int id) {
+        size_t last = entries.size() - 1;
+        swapEntries(slot[id], last);
+        entries.pop_back();
+        lefts.pop_back();
+        tops.pop_back();
+        rights.pop_back();
+        bottoms.pop_back();
+        freeIds.push_back(id);
+        unsorted = true;
+    }
 
-            int x2 = static_cast<int>(x + innerRadius * cos(angle2));
-            int y2 = static_cast<int>(y + innerRadius * sin(angle2));
+    void update(int id, const Box& box) {
+        size_t i = slot[id];
+        lefts[i] = box.left;
+        tops[i] = box.top;
+        rights[i] = box.right;
+        bottoms[i] = box.bottom;
+        if (box.right >= box.left) maxWidth = (std::max)(maxWidth, box.right - box.left);
+        if (unsorted) return;
+
+        while (i > 0 && lefts[i - 1] > lefts[i]) {
+            swapEntries(i - 1, i);
+            i--;
+        }
+        while (i + 1 < entries.size() && lefts[i + 1] < lefts[i]) {
+            swapEntries(i, i + 1);
+            i++;
+        }
+    }
 
-            console_graphics.line(x1, y1, x2, y2);
+    // Calls f(shape) for every shape whose box overlaps the given one
+    template <class F>
+    void forEachIn(const Box& box, F f) {
+        sort();
+        size_t i = std::lower_bound(lefts.begin(), lefts.end(), box.left - maxWidth) - lefts.begin();
+        for (; i < entries.size() && lefts[i] <= box.right; i++) {
+            if (rights[i] >= box.left && tops[i] <= box.bottom && box.top <= bottoms[i]) {
+                f(entries[i].shape);
+            }
         }
+    }
 
-        if (getDrawTrail()) {
-            // Draw the trail for stars
-            for (const auto& point : trail) {
-                drawPixel(point.first, point.second, c);
+    // Calls f(a, b) once for every pair of shapes whose boxes overlap
+    template <class F>
+    void forEachOverlap(F f) {
+        sort();
+        size_t n = entries.size();
+        for (size_t i = 0; i < n; i++) {
+            int right = rights[i], top = tops[i], bottom = bottoms[i];
+            for (size_t j = i + 1; j < n && lefts[j] <= right; j++) {
+                if ((top <= bottoms[j]) & (tops[j] <= bottom)) {
+                    f(entries[i].shape, entries[j].shape);
+                }
             }
         }
     }
+};
 
-    void move(int dx, int dy) override {
-        hide();
+SweepAndPrune sweep_and_prune;
 
-        if (getDrawTrail()) {
-            trail.push_back(std::make_pair(x, y));
-        }
+// Fixed-point shape transforms: scale and matrix entries are 16.16,
+// angles are whole degrees
+const int FIXED_ONE = 65536;
+const int TURN = 360;
 
-        x += dx;
-        y += dy;
+// Model vertices of every shape and their rotated and scaled copies,
+// relative to the shape's anchor, with the bounds of the copies. Arrays are
+// vertex-major: vertex v of all slots is contiguous, so a pass over many
+// shapes is a straight loop the compiler vectorizes, with no per-shape
+// trigonometry. Unused vertices repeat the first one and do not change bounds.
+class VertexPool
+{
+public:
+    static const int MAX = 10;  // vertices per shape, as in Collider
 
-        show();
+private:
+    std::vector<int> modelX[MAX], modelY[MAX];
+    std::vector<int> localX[MAX], localY[MAX];
+    std::vector<int> lefts, tops, rights, bottoms;
+    std::vector<int> angles, scales;
+    std::vector<int> xx, xy, yx, yy;    // linear part per slot, from angle and scale
+    std::vector<int> counts;
+    std::vector<int> freeSlots;
+    std::vector<int> dirty;
+    std::vector<char> isDirty;
+
+    static void apply(const int* mx, const int* my, int* lx, int* ly,
+                      const int* xx, const int* xy, const int* yx, const int* yy, size_t n) {
+        for (size_t s = 0; s < n; s++) {
+            lx[s] = int(((long long)xx[s] * mx[s] + (long long)xy[s] * my[s] + FIXED_ONE / 2) >> 16);
+            ly[s] = int(((long long)yx[s] * mx[s] + (long long)yy[s] * my[s] + FIXED_ONE / 2) >> 16);
+        }
     }
 
-    void setSize(int s) override {
-        double ratio = static_cast<double>(s) / getSize();
-        innerRadius = static_cast<int>(innerRadius * ratio);
-        outerRadius = static_cast<int>(outerRadius * ratio);
+    void bound(size_t first, size_t n) {
+        for (size_t s = first; s < first + n; s++) {
+            lefts[s] = rights[s] = localX[0][s];
+            tops[s] = bottoms[s] = localY[0][s];
+        }
+        for (int v = 1; v < MAX; v++) {
+            const int* lx = localX[v].data();
+            const int* ly = localY[v].data();
+            for (size_t s = first; s < first + n; s++) {
+                lefts[s] = (std::min)(lefts[s], lx[s]);
+                rights[s] = (std::max)(rights[s], lx[s]);
+                tops[s] = (std::min)(tops[s], ly[s]);
+                bottoms[s] = (std::max)(bottoms[s], ly[s]);
+            }
+        }
     }
 
-    std::string getType() const override {
-        return "Star";
+public:
+    // 16.16 cosine of whole degrees, sine is cosine shifted by 270
+    static int cosine(int degrees) {
+        static int table[TURN];
+        static bool tabulated = false;
+        if (!tabulated) {
+            for (int i = 0; i < TURN; i++) {
+                table[i] = int(lround(cos(i * 2 * M_PI / TURN) * FIXED_ONE));
+            }
+            tabulated = true;
+        }
+        return table[((degrees % TURN) + TURN) % TURN];
     }
 
-protected:
-    void drawTrailPixels(int c) {
-        for (const auto& point : trail) {
-            drawPixel(point.first, point.second, c);
+    static int sine(int degrees) { return cosine(degrees + 270); }
+
+    int acquire() {
+        int slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            // nothing of the previous owner's transform carries over
+            angles[slot] = 0;
+            scales[slot] = FIXED_ONE;
+            xx[slot] = yy[slot] = FIXED_ONE;
+            xy[slot] = yx[slot] = 0;
+            lefts[slot] = tops[slot] = rights[slot] = bottoms[slot] = 0;
+            for (int v = 0; v < MAX; v++) {
+                modelX[v][slot] = modelY[v][slot] = localX[v][slot] = localY[v][slot] = 0;
+            }
+        }
+        else {
+            slot = int(counts.size());
+            for (int v = 0; v < MAX; v++) {
+                modelX[v].push_back(0);
+                modelY[v].push_back(0);
+                localX[v].push_back(0);
+                localY[v].push_back(0);
+            }
+            angles.push_back(0);
+            scales.push_back(FIXED_ONE);
+            xx.push_back(FIXED_ONE);
+            xy.push_back(0);
+            yx.push_back(0);
+            yy.push_back(FIXED_ONE);
+            lefts.push_back(0);
+            tops.push_back(0);
+            rights.push_back(0);
+            bottoms.push_back(0);
+            counts.push_back(0);
+            isDirty.push_back(0);
         }
+        counts[slot] = 0;
+        return slot;
     }
-};
-
-class Rockstar : public Shape
-{
-    int size;
-    std::vector<std::pair<int, int>> points; // Points to draw the star
-    std::vector<std::pair<int, int>> trail;  // Trail coordinates
 
-public:
-    Rockstar(int a, int b, int s, int c) : Shape(a, b, c), size(s) {
-        calculatePoints();
-        show(); // Display the initial rockstar
+    void release(int slot) {
+        counts[slot] = 0;
+        freeSlots.push_back(slot);
     }
 
-    int getSize() override {
-        return this->size;
+    void setModel(int slot, const Grfx::Point* pts, int n) {
+        counts[slot] = n;
+        for (int v = 0; v < MAX; v++) {
+            modelX[v][slot] = n == 0 ? 0 : pts[v < n ? v : 0].x;
+            modelY[v][slot] = n == 0 ? 0 : pts[v < n ? v : 0].y;
+        }
+        touch(slot);
     }
 
-    std::string getType() const override {
-        return "Rockstar";
+    // Rotation by angle degrees, then uniform scale; applied by the next pass
+    void setTransform(int slot, int angle, int scale) {
+        angles[slot] = angle;
+        scales[slot] = scale;
+        touch(slot);
     }
 
-    void setColor(int c) override {
-        color = c;
+    void touch(int slot) {
+        if (isDirty[slot]) return;
+        isDirty[slot] = 1;
+        dirty.push_back(slot);
     }
 
-    void draw(int c) override {
-        // Draw the star shape using calculated points and connecting them
-        for (size_t i = 0; i < points.size(); ++i) {
-            drawPixel(points[i].first, points[i].second, c);
-
-            // Connect each point to the next one
-            size_t nextIndex = (i + 2) % points.size(); // Connect every second point
-            drawLine(points[i].first, points[i].second, points[nextIndex].first, points[nextIndex].second, c);
+    // Transforms every changed slot. A few are done one by one, otherwise
+    // all slots go through the vectorized pass.
+    void transform() {
+        if (dirty.empty()) return;
+        for (int slot : dirty) {
+            int c = int((long long)cosine(angles[slot]) * scales[slot] / FIXED_ONE);
+            int s = int((long long)sine(angles[slot]) * scales[slot] / FIXED_ONE);
+            xx[slot] = c;
+            xy[slot] = -s;
+            yx[slot] = s;
+            yy[slot] = c;
         }
-
-        if (getDrawTrail()) {
-            // Draw the trail for the rockstar
-            for (const auto& point : trail) {
-                drawPixel(point.first, point.second, c);
+        if (dirty.size() * 8 < counts.size()) {
+            for (int slot : dirty) {
+                for (int v = 0; v < MAX; v++) {
+                    apply(&modelX[v][slot], &modelY[v][slot], &localX[v][slot], &localY[v][slot],
+                          &xx[slot], &xy[slot], &yx[slot], &yy[slot], 1);
+                }
+                bound(slot, 1);
+            }
+        }
+        else {
+            for (int v = 0; v < MAX; v++) {
+                apply(modelX[v].data(), modelY[v].data(), localX[v].data(), localY[v].data(),
+                      xx.data(), xy.data(), yx.data(), yy.data(), counts.size());
             }
+            bound(0, counts.size());
         }
+        for (int slot : dirty) isDirty[slot] = 0;
+        dirty.clear();
     }
 
-    void resize(int delta) override {
-        //     
-        size += delta;
+    // Transformed vertices of a slot moved to (x, y); returns their number
+    int vertices(int slot, int x, int y, Grfx::Point* out) {
+        if (isDirty[slot]) transform();
+        int n = counts[slot];
+        for (int v = 0; v < n; v++) {
+            out[v] = { x + localX[v][slot], y + localY[v][slot] };
+        }
+        return n;
+    }
 
-        //  
-        hide();
-        calculatePoints();
-        show();
+    // Bounds of the vertices moved to (x, y), false for a slot without vertices
+    bool bounds(int slot, int x, int y, Box& box) {
+        if (isDirty[slot]) transform();
+        if (counts[slot] == 0) return false;
+        box = { x + lefts[slot], y + tops[slot], x + rights[slot], y + bottoms[slot] };
+        return true;
     }
+};
 
-    void move(int dx, int dy) override {
-        hide(); // Hide the current position
+VertexPool vertex_pool;
 
-        // Save the current position to the trail if drawTrail is true
-        if (getDrawTrail()) {
-            trail.push_back(std::make_pair(x, y));
-        }
+class Shape
+{
+    friend class Group;
 
-        x += dx;
-        y += dy;
+protected:
+    int x, y, color, size;  // size of the model, see getSize()
+    int angle = 0;          // degrees
+    int scale = FIXED_ONE;  // 16.16
+    bool drawTrail = false;
+    bool cacheSprite = true;
+    bool visible = false;
+    int trail;
+    int body;   // entry in sweep_and_prune, -1 while part of a group
+    int model;  // slot in vertex_pool
 
-        calculatePoints(); // Recalculate points based on the new position
+    void drawPixel(int x, int y, int c) {
+        console_graphics.setcolor(c);
+        console_graphics.rectangle(x, y, x + 1, y + 1);
+    }
 
-        show(); // Display the rockstar after movement
+    // Sets the untransformed outline, relative to the anchor (x, y),
+    // and the size it has at scale 1
+    void setModel(const Grfx::Point* pts, int n, int modelSize) {
+        vertex_pool.setModel(model, pts, n);
+        size = modelSize;
+        invalidateSprite();
     }
 
-private:
-    void calculatePoints() {
-        points.clear();
+    int vertices(Grfx::Point* pts) { return vertex_pool.vertices(model, x, y, pts); }
+
+    // Draws the outline in the current colour with the anchor at (ax, ay)
+    virtual void rasterize(int ax, int ay) {
+        Grfx::Point pts[VertexPool::MAX];
+        int n = vertex_pool.vertices(model, ax, ay, pts);
+        if (n == 2) console_graphics.line(pts[0].x, pts[0].y, pts[1].x, pts[1].y);
+        else console_graphics.polygon(pts, n);
+    }
 
-        double angle = -M_PI / 2; // Start from the top point
-        double angleIncrement = 2 * M_PI / 5; // 5 points for a five-pointed star
+    Grfx::Sprite capture() {
+        console_graphics.setcolor(color);
+        console_graphics.beginSprite(x, y);
+        rasterize(x, y);
+        return console_graphics.endSprite();
+    }
 
-        for (int i = 0; i < 5; ++i) {
-            int px = static_cast<int>(x + size * std::cos(angle));
-            int py = static_cast<int>(y + size * std::sin(angle));
-            points.push_back(std::make_pair(px, py));
-            angle += angleIncrement;
+    const Grfx::Sprite& sprite() {
+        const Grfx::Sprite* cached = sprite_cache.find(this);
+        return cached ? *cached : sprite_cache.insert(this, capture());
+    }
+
+    // Draws the outline in colour c. The outline only changes by translation
+    // when the shape moves, so it is rasterized once into a sprite and blitted;
+    // rotating or scaling rasterizes it again.
+    void drawBody(int c) {
+        if (!cacheSprite || !spriteFits()) {
+            console_graphics.setcolor(c);
+            rasterize(x, y);
+            return;
         }
+
+        const Grfx::Sprite& s = sprite();
+        console_graphics.setcolor(c);
+        if (c == color) console_graphics.blit(s, x, y);
+        else console_graphics.stamp(s, x, y);
     }
 
-    void drawLine(int x1, int y1, int x2, int y2, int c) {
-        console_graphics.line(x1, y1, x2, y2);
+    // Hiding clears pixels on the shapes layer shared by all shapes,
+    // so visible shapes overlapping the cleared area are drawn again
+    void restoreOverlapping() {
+        std::vector<Shape*> overlapping;
+        sweep_and_prune.forEachIn(box(), [&](Shape* other) {
+            if (other != this && other->visible) overlapping.push_back(other);
+        });
+        for (Shape* other : overlapping) {
+            other->show();
+        }
     }
-};
 
-class MyRectangle : public Shape
-{
-    int width, height;
-    std::vector<std::pair<int, int>> trail;
+    void invalidateSprite() { sprite_cache.erase(this); }
 
-public:
-    MyRectangle(int a, int b, int w, int h, int c) : Shape(a, b, c), width(w), height(h) { show(); }
+    // A sprite holds every pixel of the bounds, so shapes too big for the
+    // whole cache budget are drawn directly
+    bool spriteFits() {
+        Box b = box();
+        if (b.left > b.right || b.top > b.bottom) return true;
+        return (unsigned long long)(b.right - b.left + 1) * (b.bottom - b.top + 1) * sizeof(uint32_t) <= sprite_cache.budget();
+    }
 
-    void draw(int c) override {
-        console_graphics.setcolor(c);
-        console_graphics.rectangle(x, y, x + width, y + height);
+    // Trail pixels live on their own layer, so hiding the shape leaves them intact
+    void drawTrailPixels(int c) {
+        const int BATCH = 256;
+        Grfx::Point batch[BATCH];
+        int n = 0;
 
-        if (drawTrail) {
-            for (const auto& point : trail) {
-                drawPixel(point.first, point.second, c);
+        console_graphics.setcolor(c);
+        trail_store.forEach(trail, [&](int px, int py) {
+            batch[n++] = { px, py };
+            if (n == BATCH) {
+                console_graphics.points(batch, n, 2);
+                n = 0;
             }
-        }
+        });
+        console_graphics.points(batch, n, 2);
     }
 
+    void paintTrail(int c) {
+        trail_store.setColor(trail, c);
+        console_graphics.setlayer(Grfx::TRAILS);
+        drawTrailPixels(c);
+        console_graphics.setlayer(Grfx::SHAPES);
+    }
 
-    void move(int dx, int dy) override {
-        hide();
+    // Adds the current position to the trail
+    void recordTrail() {
+        trail_store.append(trail, x, y);
+        trail_store.setColor(trail, color);
+        if (!rendering) return;
+        console_graphics.setlayer(Grfx::TRAILS);
+        drawPixel(x, y, color);
+        console_graphics.setlayer(Grfx::SHAPES);
+    }
 
+public:
+    Shape(int a, int b, int c) : x(a), y(b), color(c), size(1), drawTrail(false), trail(trail_store.create()), body(sweep_and_prune.add(this)), model(vertex_pool.acquire()) {}
+
+    virtual ~Shape() {
+        invalidateSprite();
+        trail_store.release(trail);
+        if (body >= 0) sweep_and_prune.remove(body);
+        vertex_pool.release(model);
+    };
+    virtual void draw(int c) { drawBody(c); }
+    // Moves without drawing; the caller hides and shows the shape around it
+    virtual void translate(int dx, int dy) {
+        // Save the current position to the trail if drawTrail is true
         if (drawTrail) {
-            trail.push_back(std::make_pair(x, y));
+            recordTrail();
         }
 
         x += dx;
         y += dy;
+    }
 
+    void move(int dx, int dy) {
+        hide();
+        translate(dx, dy);
         show();
     }
-
-    void setSize(int s) override {
-        double ratio = static_cast<double>(s) / getSize();
-        width = static_cast<int>(width * ratio);
-        height = static_cast<int>(height * ratio);
+    virtual void setColor(int c) { color = c; invalidateSprite(); }
+
+    // Sizes go through the scale of the unchanged model, so repeated
+    // resizing does not accumulate rounding errors
+    virtual void setSize(int s) {
+        if (size == 0) return;
+        scale = int(((long long)s * FIXED_ONE + size / 2) / size);
+        vertex_pool.setTransform(model, angle, scale);
+        invalidateSprite();
     }
-};
+    int getSize() { return int(((long long)size * scale + FIXED_ONE / 2) / FIXED_ONE); }
+    void resize(int delta) { setSize(getSize() + delta); }
+
+    // Turns the shape about its anchor, clockwise on screen; the caller
+    // hides and shows it around, as for translate()
+    virtual void rotate(int degrees) {
+        angle = ((angle + degrees) % TURN + TURN) % TURN;
+        vertex_pool.setTransform(model, angle, scale);
+        invalidateSprite();
+    }
+    int getAngle() { return angle; }
 
-class Circle : public Shape
-{
-    int radius;
-    std::vector<std::pair<int, int>> trail;
+    void show() {
+        if (rendering) draw(color);
+        visible = true;
+        if (body >= 0) sweep_and_prune.update(body, box());
+    }
+    // restore = false leaves redrawing the shapes underneath to the caller
+    void hide(bool restore = true) {
+        visible = false;
+        if (!rendering) return;
+        draw(BGCOLOR);
+        if (restore) restoreOverlapping();
+    }
+    void SetTrail(bool value) {
+        drawTrail = value;
+        if (rendering) paintTrail(drawTrail ? color : BGCOLOR);
+    }
+    void showTrail() {
+        if (drawTrail) paintTrail(color);
+    }
+    void SetSpriteCache(bool value) { cacheSprite = value; invalidateSprite(); }
+    void toggleTrail() { SetTrail(!drawTrail); }
 
-public:
-    Circle(int a, int b, int r, int c) : Shape(a, b, c), radius(r) { show(); }
+    int getX() { return this->x; }
+    int getY() { return this->y; }
+    int getColor() { return this->color; }
+    bool getDrawTrail() { return this->drawTrail; }
+    bool isVisible() { return this->visible; }
 
-    std::string getType() const override {
-        return "Circle";
+    virtual Collider collider() {
+        Collider c{};
+        c.n = vertices(c.pts);
+        c.kind = c.n == 2 ? Collider::SEGMENT : Collider::POLYGON;
+        return c;
     }
 
-    void setColor(int c) override {
-        color = c;
+    // Narrow phase outlines, moved by (dx, dy); a group has one per part
+    virtual void colliders(int dx, int dy, std::vector<Collider>& out) {
+        Collider c = collider();
+        c.cx += dx;
+        c.cy += dy;
+        for (int i = 0; i < c.n; i++) {
+            c.pts[i].x += dx;
+            c.pts[i].y += dy;
+        }
+        out.push_back(c);
     }
 
-    void draw(int c) override {
-        console_graphics.setcolor(c);
-        console_graphics.circle(x, y, radius);
+    Box box() {
+        Box b;
+        if (vertex_pool.bounds(model, x, y, b)) return b;
 
-        if (drawTrail) {
-            for (const auto& point : trail) {
-                drawPixel(point.first, point.second, c);
-            }
+        Collider c = collider();
+        if (c.kind == Collider::CIRCLE) {
+            return { c.cx - c.r, c.cy - c.r, c.cx + c.r, c.cy + c.r };
         }
+        b = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+        for (int i = 0; i < c.n; i++) {
+            b.left = (std::min)(b.left, c.pts[i].x);
+            b.top = (std::min)(b.top, c.pts[i].y);
+            b.right = (std::max)(b.right, c.pts[i].x);
+            b.bottom = (std::max)(b.bottom, c.pts[i].y);
+        }
+        return b;
     }
 
-    void resize(int delta) override {
-        radius += delta;
+    virtual std::string getType() const {
+        return "Shape";
     }
+};
 
-    void move(int dx, int dy) override {
-        hide();
+// Other chunks may cover the same pixels; repaint() draws them again
+void TrailStore::erasePixels(const Chunk& chunk) {
+    if (!rendering) return;
+    console_graphics.setlayer(Grfx::TRAILS);
+    console_graphics.setcolor(BGCOLOR);
+    decode(chunk, [](int px, int py) {
+        Grfx::Point p = { px, py };
+        console_graphics.points(&p, 1, 2);
+    });
+    console_graphics.setlayer(Grfx::SHAPES);
+    // points are drawn as 2 x 2 dots
+    damageLeft = (std::min)(damageLeft, chunk.left);
+    damageTop = (std::min)(damageTop, chunk.top);
+    damageRight = (std::max)(damageRight, chunk.right + 1);
+    damageBottom = (std::max)(damageBottom, chunk.bottom + 1);
+}
 
-        if (drawTrail) {
-            trail.push_back(std::make_pair(x, y));
+void TrailStore::repaint() {
+    int left = damageLeft, top = damageTop, right = damageRight, bottom = damageBottom;
+    damageLeft = damageTop = INT_MAX;
+    damageRight = damageBottom = INT_MIN;
+    if (left > right || !rendering) return;
+
+    const int BATCH = 256;
+    Grfx::Point batch[BATCH];
+    int n = 0;
+    auto flushBatch = [&]() {
+        console_graphics.points(batch, n, 2);
+        n = 0;
+    };
+    // dots that start up to one pixel before the area reach into it
+    int w = right - left + 2, h = bottom - top + 2;
+    bool small = (long long)w * h <= 1 << 20;
+    // newer chunks come later and win; with a small area each dot is
+    // collected first and plotted once, however often the trails cross it
+    std::vector<unsigned char> cover(small ? size_t(w) * h : 0, 0);
+    console_graphics.setlayer(Grfx::TRAILS);
+    for (const Chunk& chunk : chunks) {
+        int c = colors[chunk.trail];
+        if (c == BGCOLOR || chunk.left > right || chunk.right + 1 < left ||
+            chunk.top > bottom || chunk.bottom + 1 < top) continue;
+        if (small) {
+            decode(chunk, [&](int px, int py) {
+                if (px > right || px + 1 < left || py > bottom || py + 1 < top) return;
+                cover[size_t(py - top + 1) * w + (px - left + 1)] = (unsigned char)(c + 1);
+            });
+            continue;
         }
+        console_graphics.setcolor(c);
+        decode(chunk, [&](int px, int py) {
+            if (px > right || px + 1 < left || py > bottom || py + 1 < top) return;
+            batch[n++] = { px, py };
+            if (n == BATCH) flushBatch();
+        });
+        flushBatch();
+    }
+    for (int c = 1; small && c <= 8; c++) {
+        console_graphics.setcolor(c - 1);
+        for (int row = 0; row < h; row++) {
+            for (int col = 0; col < w; col++) {
+                if (cover[size_t(row) * w + col] != c) continue;
+                batch[n++] = { left - 1 + col, top - 1 + row };
+                if (n == BATCH) flushBatch();
+            }
+        }
+        flushBatch();
+    }
+    console_graphics.setlayer(Grfx::SHAPES);
+}
 
-        x += dx;
-        y += dy;
-
+class Segment : public Shape
+{
+public:
+    Segment(int a, int b, int da, int db, int c) : Shape(a, b, c) {
+        Grfx::Point ends[2] = { { 0, 0 }, { da, db } };
+        setModel(ends, 2, da);
         show();
     }
 
-    int getSize() override
-    {
-        return this->radius;
+    void setColor(int c) override {
+        color = c;
+        invalidateSprite();
     }
 
-    void setSize(int s) override {
-        double ratio = static_cast<double>(s) / getSize();
-        radius = static_cast<int>(radius * ratio);
+    std::string getType() const override {
+        return "Segment";
     }
 };
 
-class Square : public Shape
+class Star : public Shape
 {
-    int side;
-    std::vector<std::pair<int, int>> trail;
-
 public:
-    Square(int a, int b, int s, int c) : Shape(a, b, c), side(s) { show(); }
+    // Outline alternating outer and inner vertices
+    Star(int a, int b, int inner, int outer, int c) : Shape(a, b, c) {
+        Grfx::Point vertices[10];
+        for (int i = 0; i < 10; ++i) {
+            int radius = i % 2 ? inner : outer;
+
+            vertices[i].x = int(lround(double(radius) * VertexPool::cosine(i * 36) / FIXED_ONE));
+            vertices[i].y = int(lround(double(radius) * VertexPool::sine(i * 36) / FIXED_ONE));
+        }
+        setModel(vertices, 10, inner);
+        show();
+    }
 
     void setColor(int c) override {
         color = c;
-    }
-
-    int getSize() override {
-        return this->side;
+        invalidateSprite();
     }
 
     std::string getType() const override {
-        return "Square";
+        return "Star";
     }
+};
 
-    void draw(int c) override {
-        console_graphics.setcolor(c);
-        console_graphics.rectangle(x, y, x + side, y + side);
-
-        if (drawTrail) {
-            for (const auto& point : trail) {
-                drawPixel(point.first, point.second, c);
-            }
+class Rockstar : public Shape
+{
+public:
+    Rockstar(int a, int b, int s, int c) : Shape(a, b, c) {
+        // Every second of 5 points gives a five-pointed star, starting from the top point
+        Grfx::Point points[5];
+        for (int i = 0; i < 5; ++i) {
+            int angle = -90 + i * 144;
+            points[i].x = int(lround(double(s) * VertexPool::cosine(angle) / FIXED_ONE));
+            points[i].y = int(lround(double(s) * VertexPool::sine(angle) / FIXED_ONE));
         }
+        setModel(points, 5, s);
+        show(); // Display the initial rockstar
     }
 
-    void resize(int delta) override {
-        side += delta;
+    std::string getType() const override {
+        return "Rockstar";
     }
 
-    void move(int dx, int dy) override {
-        hide();
-
-        if (drawTrail) {
-            trail.push_back(std::make_pair(x, y));
-        }
-
-        x += dx;
-        y += dy;
-
-        show();
+    void setColor(int c) override {
+        color = c;
+        invalidateSprite();
     }
+};
 
-    void setSize(int s) override {
-        double ratio = static_cast<double>(s) / getSize();
-        side = static_cast<int>(side * ratio);
+class MyRectangle : public Shape
+{
+public:
+    MyRectangle(int a, int b, int w, int h, int c) : Shape(a, b, c) {
+        Grfx::Point corners[4] = { { 0, 0 }, { w, 0 }, { w, h }, { 0, h } };
+        setModel(corners, 4, w);
+        show();
     }
 };
 
-void menu(const std::vector<Shape*>& objects) {
-    
-    for (const auto& obj : objects)
-    {
-        obj->hide();
+class Circle : public Shape
+{
+public:
+    Circle(int a, int b, int r, int c) : Shape(a, b, c) {
+        setModel(nullptr, 0, r);
+        show();
+    }
+
+    std::string getType() const override {
+        return "Circle";
+    }
+
+    void setColor(int c) override {
+        color = c;
+        invalidateSprite();
+    }
+
+    // Rotation leaves a circle as it is, only the scale applies
+    void rasterize(int ax, int ay) override {
+        console_graphics.circle(ax, ay, getSize());
+    }
+
+    // Matches what circle() draws: diameter radius, inscribed in the box at (x - radius, y - radius)
+    Collider collider() override {
+        int radius = getSize();
+        Collider c;
+        c.kind = Collider::CIRCLE;
+        c.r = radius / 2;
+        c.cx = x - radius + c.r;
+        c.cy = y - radius + c.r;
+        c.n = 0;
+        return c;
+    }
+};
+
+class Square : public Shape
+{
+public:
+    Square(int a, int b, int s, int c) : Shape(a, b, c) {
+        Grfx::Point corners[4] = { { 0, 0 }, { s, 0 }, { s, s }, { 0, s } };
+        setModel(corners, 4, s);
+        show();
+    }
+
+    void setColor(int c) override {
+        color = c;
+        invalidateSprite();
+    }
+
+    std::string getType() const override {
+        return "Square";
+    }
+};
+
+// Node holding shapes and other groups. Parts keep their positions relative
+// to the group's anchor, so moving the group changes only the anchor; the
+// parts are placed at render time. The group alone is in the broad phase,
+// with the bounds of its parts kept as its outline, and by default it is
+// drawn from one cached sprite of all parts.
+class Group : public Shape
+{
+    std::vector<Shape*> parts;
+    std::vector<Grfx::Point> home;  // part positions at angle 0 and scale 1
+    std::vector<int> homeSize;      // part sizes at scale 1, scales for nested groups
+    Box bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };   // of the parts, relative to the anchor
+
+    static void extend(Box& b, const Box& p) {
+        b.left = (std::min)(b.left, p.left);
+        b.top = (std::min)(b.top, p.top);
+        b.right = (std::max)(b.right, p.right);
+        b.bottom = (std::max)(b.bottom, p.bottom);
+    }
+
+    // The outline is the bounding rectangle of the parts. It is kept
+    // untransformed, the parts carry the group's angle and scale. The size
+    // at scale 1 is taken when parts are added and stays while the group
+    // turns, so resizing nested groups does not drift.
+    void updateOutline(int modelSize) {
+        if (parts.empty()) {
+            setModel(nullptr, 0, 1);
+            return;
+        }
+        const Box& b = bounds;
+        Grfx::Point corners[4] = { { b.left, b.top }, { b.right, b.top }, { b.right, b.bottom }, { b.left, b.bottom } };
+        setModel(corners, 4, modelSize);
+    }
+
+    // Moves and sizes the parts for the group's angle and scale, the same
+    // way the vertex pool transforms vertices
+    void arrange() {
+        int c = int((long long)VertexPool::cosine(angle) * scale / FIXED_ONE);
+        int s = int((long long)VertexPool::sine(angle) * scale / FIXED_ONE);
+        bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+        for (size_t i = 0; i < parts.size(); i++) {
+            Shape* part = parts[i];
+            part->x = int(((long long)c * home[i].x - (long long)s * home[i].y + FIXED_ONE / 2) >> 16);
+            part->y = int(((long long)s * home[i].x + (long long)c * home[i].y + FIXED_ONE / 2) >> 16);
+            int sized = int(((long long)homeSize[i] * scale + FIXED_ONE / 2) / FIXED_ONE);
+            if (Group* inner = dynamic_cast<Group*>(part)) {
+                inner->scale = sized;
+                inner->arrange();
+                inner->invalidateSprite();
+            }
+            else {
+                part->setSize(sized);
+            }
+            extend(bounds, part->box());
+        }
+        updateOutline(size);
+    }
+
+    // Angles only; the outermost group arranges the whole subtree once
+    void turn(int degrees) {
+        angle = ((angle + degrees) % TURN + TURN) % TURN;
+        for (Shape* part : parts) {
+            if (Group* inner = dynamic_cast<Group*>(part)) inner->turn(degrees);
+            else part->rotate(degrees);
+        }
+    }
+
+    // Draws every part in its own colour, or all of them erased
+    void paint(int ax, int ay, bool erase) {
+        if (erase) console_graphics.setcolor(BGCOLOR);
+        for (Shape* part : parts) {
+            if (Group* inner = dynamic_cast<Group*>(part)) {
+                inner->paint(ax + part->x, ay + part->y, erase);
+                continue;
+            }
+            if (!erase) console_graphics.setcolor(part->color);
+            part->rasterize(ax + part->x, ay + part->y);
+        }
+    }
+
+public:
+    Group(int a, int b, int c) : Shape(a, b, c) {
+        setModel(nullptr, 0, 1);
+        show();
+    }
+
+    ~Group() {
+        for (Shape* part : parts) {
+            delete part;
+        }
+    }
+
+    // Takes over shapes that are not in a group yet; they stay where they are.
+    // The caller shows the group again.
+    void add(const std::vector<Shape*>& more) {
+        Box vacated = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+        for (Shape* part : more) {
+            extend(vacated, part->box());
+            part->hide(false);
+        }
+        if (rendering && !more.empty()) {
+            sweep_and_prune.forEachIn(vacated, [](Shape* other) {
+                if (other->isVisible()) other->show();
+            });
+        }
+        // undo the group's transform to find where the part is at home
+        long long c = VertexPool::cosine(angle), s = VertexPool::sine(angle);
+        for (Shape* part : more) {
+            sweep_and_prune.remove(part->body);
+            part->body = -1;
+            part->x -= x;
+            part->y -= y;
+            extend(bounds, part->box());
+            parts.push_back(part);
+            home.push_back({ int((c * part->x + s * part->y) / scale), int((c * part->y - s * part->x) / scale) });
+            Group* inner = dynamic_cast<Group*>(part);
+            homeSize.push_back(int((long long)(inner ? inner->scale : part->getSize()) * FIXED_ONE / scale));
+        }
+        updateOutline(int((long long)(std::max)(bounds.right - bounds.left, bounds.bottom - bounds.top) * FIXED_ONE / scale));
+    }
+
+    void add(Shape* part) { add(std::vector<Shape*>{ part }); }
+
+    // Hands the parts back as independent, hidden shapes
+    std::vector<Shape*> release() {
+        std::vector<Shape*> released;
+        released.swap(parts);
+        for (Shape* part : released) {
+            part->x += x;
+            part->y += y;
+            part->body = sweep_and_prune.add(part);
+        }
+        home.clear();
+        homeSize.clear();
+        angle = 0;
+        scale = FIXED_ONE;
+        bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+        updateOutline(1);
+        return released;
+    }
+
+    const std::vector<Shape*>& getParts() const { return parts; }
+
+    void rasterize(int ax, int ay) override {
+        paint(ax, ay, false);
+    }
+
+    void draw(int c) override {
+        if (!cacheSprite || !spriteFits()) {
+            paint(x, y, c == BGCOLOR);
+            return;
+        }
+        const Grfx::Sprite& s = sprite();
+        console_graphics.setcolor(c);
+        if (c == BGCOLOR) console_graphics.stamp(s, x, y);
+        else console_graphics.blit(s, x, y);
+    }
+
+    void setColor(int c) override {
+        color = c;
+        for (Shape* part : parts) {
+            part->setColor(c);
+        }
+        invalidateSprite();
+    }
+
+    // The parts turn about their own anchors and move round the group's.
+    // Positions and sizes come from home, so turning and resizing over and
+    // over does not accumulate rounding errors. Every part is updated at
+    // once, in one pass over the subtree; drawing and collisions then read
+    // the parts as they are.
+    void rotate(int degrees) override {
+        turn(degrees);
+        arrange();
+        invalidateSprite();
+    }
+
+    void setSize(int s) override {
+        if (size == 0 || s <= 0) return;
+        scale = int(((long long)s * FIXED_ONE + size / 2) / size);
+        arrange();
+        invalidateSprite();
+    }
+
+    // Outlines of the parts rather than the bounding rectangle
+    void colliders(int dx, int dy, std::vector<Collider>& out) override {
+        for (Shape* part : parts) {
+            part->colliders(dx + x, dy + y, out);
+        }
+    }
+
+    std::string getType() const override {
+        return "Group";
+    }
+};
+
+// Narrow phase
+
+long long cross(Grfx::Point o, Grfx::Point a, Grfx::Point b) {
+    return (long long)(a.x - o.x) * (b.y - o.y) - (long long)(a.y - o.y) * (b.x - o.x);
+}
+
+bool onSegment(Grfx::Point p, Grfx::Point a, Grfx::Point b) {
+    return (std::min)(a.x, b.x) <= p.x && p.x <= (std::max)(a.x, b.x)
+        && (std::min)(a.y, b.y) <= p.y && p.y <= (std::max)(a.y, b.y);
+}
+
+bool segmentsIntersect(Grfx::Point p1, Grfx::Point p2, Grfx::Point q1, Grfx::Point q2) {
+    long long d1 = cross(q1, q2, p1), d2 = cross(q1, q2, p2);
+    long long d3 = cross(p1, p2, q1), d4 = cross(p1, p2, q2);
+    if (((d1 > 0 && d2 < 0) || (d1 < 0 && d2 > 0)) && ((d3 > 0 && d4 < 0) || (d3 < 0 && d4 > 0))) return true;
+    return (d1 == 0 && onSegment(p1, q1, q2)) || (d2 == 0 && onSegment(p2, q1, q2))
+        || (d3 == 0 && onSegment(q1, p1, p2)) || (d4 == 0 && onSegment(q2, p1, p2));
+}
+
+double distanceSquared(Grfx::Point p, Grfx::Point a, Grfx::Point b) {
+    double dx = b.x - a.x, dy = b.y - a.y;
+    double len = dx * dx + dy * dy;
+    double t = len > 0 ? ((p.x - a.x) * dx + (p.y - a.y) * dy) / len : 0;
+    t = (std::max)(0.0, (std::min)(1.0, t));
+    double ex = a.x + t * dx - p.x, ey = a.y + t * dy - p.y;
+    return ex * ex + ey * ey;
+}
+
+// Nonzero winding, so the self-intersecting Rockstar outline counts as a solid star
+bool insidePolygon(const Collider& poly, Grfx::Point p) {
+    int winding = 0;
+    for (int i = 0; i < poly.n; i++) {
+        Grfx::Point a = poly.pts[i], b = poly.pts[(i + 1) % poly.n];
+        if (a.y <= p.y) {
+            if (b.y > p.y && cross(a, b, p) > 0) winding++;
+        }
+        else if (b.y <= p.y && cross(a, b, p) < 0) winding--;
+    }
+    return winding != 0;
+}
+
+int edgeCount(const Collider& c) {
+    return c.kind == Collider::SEGMENT ? 1 : c.n;
+}
+
+bool collide(Collider a, Collider b) {
+    if (a.kind > b.kind) std::swap(a, b);
+
+    if (a.kind == Collider::CIRCLE && b.kind == Collider::CIRCLE) {
+        long long dx = a.cx - b.cx, dy = a.cy - b.cy, r = a.r + b.r;
+        return dx * dx + dy * dy <= r * r;
+    }
+
+    if (b.kind == Collider::CIRCLE) {
+        Grfx::Point center = { b.cx, b.cy };
+        for (int i = 0; i < edgeCount(a); i++) {
+            if (distanceSquared(center, a.pts[i], a.pts[(i + 1) % a.n]) <= double(b.r) * b.r) return true;
+        }
+        return a.kind == Collider::POLYGON && insidePolygon(a, center);
+    }
+
+    if (a.kind == Collider::CIRCLE) {
+        Grfx::Point center = { a.cx, a.cy };
+        for (int i = 0; i < edgeCount(b); i++) {
+            if (distanceSquared(center, b.pts[i], b.pts[(i + 1) % b.n]) <= double(a.r) * a.r) return true;
+        }
+        return insidePolygon(b, center);
+    }
+
+    for (int i = 0; i < edgeCount(a); i++) {
+        for (int j = 0; j < edgeCount(b); j++) {
+            if (segmentsIntersect(a.pts[i], a.pts[(i + 1) % a.n], b.pts[j], b.pts[(j + 1) % b.n])) return true;
+        }
+    }
+    // No crossing edges: one is either inside the other or they are apart
+    return (b.kind == Collider::POLYGON && insidePolygon(b, a.pts[0]))
+        || (a.kind == Collider::POLYGON && insidePolygon(a, b.pts[0]));
+}
+
+// Groups collide through their parts
+bool collide(Shape* a, Shape* b) {
+    std::vector<Collider> first, second;
+    a->colliders(0, 0, first);
+    b->colliders(0, 0, second);
+    for (const Collider& ca : first) {
+        for (const Collider& cb : second) {
+            if (collide(ca, cb)) return true;
+        }
+    }
+    return false;
+}
+
+std::vector<std::pair<Shape*, Shape*>> findCollisions() {
+    std::vector<std::pair<Shape*, Shape*>> pairs;
+    sweep_and_prune.forEachOverlap([&](Shape* a, Shape* b) {
+        if (a->isVisible() && b->isVisible() && collide(a, b)) {
+            pairs.push_back({ a, b });
+        }
+    });
+    return pairs;
+}
+
+// Batch mode: the editor operations as a stream of text commands, one per line
+//   add <Type> <x> <y> <size> <color>   the fields of a saved scene line
+//   select <n>                          1-based, as in the prompt
+//   move <dx> <dy>
+//   recolor <color>
+//   resize <delta>
+//   rotate <degrees>                    clockwise about the shape's anchor
+//   group <first> <last>                replaces shapes first..last with one group
+//   ungroup                             puts the parts of the selected group back
+//   trail on|off|toggle
+//   hide | show | clear
+//   save <file> | load <file>
+// Empty lines and lines starting with # are skipped.
+struct Command
+{
+    enum Op {
+        ADD, SELECT, MOVE, RECOLOR, RESIZE, ROTATE, GROUP, UNGROUP, TRAIL, HIDE, SHOW, CLEAR, SAVE, LOAD,
+        // sent only by the interactive editor to the render thread
+        OVERLAY,        // menu backdrop on (args[0] = 1) or off
+        PAN,            // scrolls the view by args[0], args[1]
+        ANIMATE,        // starts or stops a replay of the path in text
+        COLLISIONS, SCREENSIZE, QUIT
+    } op;
+    int args[4];
+    std::string text;   // shape type for ADD, file name for SAVE and LOAD,
+                        // trajectory() codes for ANIMATE
+};
+
+
+#ifndef _WIN32
+// The console calls of the Windows build, with termios and ANSI sequences
+int _getch() {
+    termios saved, raw;
+    bool tty = tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (tty) {
+        raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
     }
+    int c = getchar();
+    if (tty) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    return c == EOF ? 27 : c;
+}
+
+void SetConsoleCP(unsigned) {}
+void SetConsoleOutputCP(unsigned) {}
+#endif
+
+void menu() {
 
     std::cout << " :" << std::endl;
 
@@ -457,31 +1382,40 @@ void menu(const std::vector<Shape*>& objects) {
     std::cout << TRAJ2 << " -   " << std::endl;
 
     std::cout << ChangeObject << " -  " << std::endl;
+    std::cout << GroupObjects << " -  " << std::endl;
+    std::cout << UngroupObject << " -  " << std::endl;
     std::cout << AddObject << " -  " << std::endl;
     std::cout << Hideobject << " -  " << std::endl;
     std::cout << Showobject << " -  " << std::endl;
     std::cout << ChangeSize << " -   " << std::endl;
     std::cout << ChangeColor << " -   " << std::endl;
+    std::cout << Rotate << " -  " << std::endl;
 
     std::cout << ClearScreen << " -  " << std::endl;
     std::cout << ScreenSize << " -   " << std::endl;
+    std::cout << Collisions << " -   " << std::endl;
     std::cout << ShapeTrail << " - /  " << std::endl;
 
     std::cout << UP << " -  " << std::endl;
     std::cout << DOWN << " -  " << std::endl;
     std::cout << LEFT << " -  " << std::endl;
     std::cout << RIGHT << " -  " << std::endl;
+    std::cout << PAN_UP << PAN_LEFT << PAN_DOWN << PAN_RIGHT << " -  " << std::endl;
 
+#ifdef _WIN32
     system("pause");
     system("cls");
-    
-    for (const auto& obj : objects)
-    {
-        obj->show();
-    }
+#else
+    std::cout << "     . . ." << std::flush;
+    _getch();
+    std::cout << "\x1b[2J\x1b[H" << std::flush;
+#endif
 }
 
 void clearConsoleLine(int line) {
+#ifndef _WIN32
+    std::cout << "\x1b[" << line + 1 << ";1H\x1b[2K" << std::flush;
+#else
     COORD cursorPosition;
     cursorPosition.X = 0;
     cursorPosition.Y = line;
@@ -493,10 +1427,13 @@ void clearConsoleLine(int line) {
     DWORD written;
     FillConsoleOutputCharacter(GetStdHandle(STD_OUTPUT_HANDLE), ' ', csbi.dwSize.X, cursorPosition, &written);
     SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE), cursorPosition);
+#endif
 }
 
-void addObject(std::vector<Shape*>& objects) {
+// Asks for the type of a new shape; false if the choice is invalid
+bool addObject(Command& cmd) {
     
+    clearConsoleLine(0);
     std::cout << "  (1 - Segment, 2 - Circle, 3 - Square, 4 - Star, 5 - Rockstar): ";
     char choice;
     std::cin >> choice;
@@ -505,45 +1442,54 @@ void addObject(std::vector<Shape*>& objects) {
     std::cin.ignore(32767, '\n');
 
     
+    cmd = Command{ Command::ADD };
     switch (choice) {
     case '1':
-        objects.push_back(new Segment(200, 200, 100, 100, COLOR));
+        cmd.text = "Segment";
+        cmd.args[0] = 200; cmd.args[1] = 200; cmd.args[2] = 100;
         break;
 
     case '2':
-        objects.push_back(new Circle(300, 300, 50, COLOR));
+        cmd.text = "Circle";
+        cmd.args[0] = 300; cmd.args[1] = 300; cmd.args[2] = 50;
         break;
 
     case '3':
-        objects.push_back(new Square(400, 400, 50, COLOR));
+        cmd.text = "Square";
+        cmd.args[0] = 400; cmd.args[1] = 400; cmd.args[2] = 50;
         break;
 
     case '4':
-        objects.push_back(new Star(500, 400, 30, 20, COLOR));
+        cmd.text = "Star";
+        cmd.args[0] = 500; cmd.args[1] = 400; cmd.args[2] = 30;
         break;
 
     case '5':
-        objects.push_back(new Rockstar(500, 400, 30, COLOR));
+        cmd.text = "Rockstar";
+        cmd.args[0] = 500; cmd.args[1] = 400; cmd.args[2] = 30;
         break;
 
     default:
         std::cout << " . ,  ." << std::endl;
         clearConsoleLine(0);
         std::cin.ignore(32767, '\n');
-        break;
+        return false;
     }
+    cmd.args[3] = COLOR;
+    return true;
 }
 
-int switchObject(const std::vector<Shape*>& objects) {
-    if (objects.size() >= 2) {
+int switchObject(int count) {
+    if (count >= 2) {
         int obj = 0;
-        std::cout << "     (    " << objects.size() << ")  ";
+        clearConsoleLine(0);
+        std::cout << "     (    " << count << ")  ";
         std::cin >> obj;
         clearConsoleLine(0);
         std::cin.ignore(32767, '\n');
         std::cin.clear();
         
-        while (obj < 0 || obj > objects.size())
+        while (obj < 0 || obj > count)
         {
             std::cout << "  ,   ";
             std::cin >> obj;
@@ -553,11 +1499,13 @@ int switchObject(const std::vector<Shape*>& objects) {
         }
         return obj - 1;
     }
-    return int(objects.size() - 1);
+    return count - 1;
 }
 
-void resizeObject(Shape*& object) {
+// Asks for the size change, 0 on bad input
+int resizeObject() {
     
+        clearConsoleLine(0);
         std::cout << "   : ";
         int newSize;
         std::cin >> newSize;
@@ -570,15 +1518,14 @@ void resizeObject(Shape*& object) {
             std::cout << " . ,   ."; std::cin >> newSize;
             clearConsoleLine(0);
             std::cin.ignore(32767);
+            return 0;
         }
-        else {
-            object->hide();
-            object->resize(object->getSize() + newSize);
-        }
+        return newSize;
 }
 
-void Recolor(Shape*& object)
+int Recolor()
 {
+    clearConsoleLine(0);
     std::cout << "  1 - , 2 - , 3 - , 4 -  ";
     int color;
     std::cin >> color;
@@ -588,124 +1535,734 @@ void Recolor(Shape*& object)
     switch (color)
     {
     case 1:
-        object->setColor(4);
-        break;
+        return 4;
     case 2:
-        object->setColor(1);
-        break;
+        return 1;
     case 3:
-        object->setColor(5);
-        break;
+        return 5;
     case 4:
-        object->setColor(7);
-        break;
+        return 7;
     default:
-        Recolor(object);
-        break;
+        return Recolor();
     }
 }
 
-void SFile(const std::vector<Shape*> objects) {
+// Creates a shape from a line of a saved scene, nullptr for an unknown type
+Shape* makeShape(const std::string& objectType, int x, int y, int size, int color) {
+    if (objectType == "Segment") {
+        return new Segment(x, y, size, size, color);
+    }
+    else if (objectType == "Circle") {
+        return new Circle(x, y, size, color);
+    }
+    else if (objectType == "Square") {
+        return new Square(x, y, size, color);
+    }
+    else if (objectType == "Rockstar") {
+        return new Rockstar(x, y, size, color);
+    }
+    else if (objectType == "Star") {
+        return new Star(x, y, size, 2 * size / 3, color);
+    }
+    return nullptr;
+}
+
+// A group is written as "Group x y count" followed by its parts,
+// with positions relative to the group
+void saveShape(std::ofstream& file, Shape* obj) {
+    if (Group* group = dynamic_cast<Group*>(obj)) {
+        file << "Group " << group->getX() << " " << group->getY() << " " << group->getParts().size() << " \n";
+        for (Shape* part : group->getParts()) {
+            saveShape(file, part);
+        }
+        return;
+    }
+    file << obj->getType() << " "
+        << obj->getX() << " "
+        << obj->getY() << " "
+        << obj->getSize() << " "
+        << obj->getColor() << " "
+        << obj->getAngle() << " \n";
+}
+
+void saveScene(const std::vector<Shape*>& objects, const std::string& filename) {
+    std::ofstream file(filename);
+
+    if (file.is_open()) {
+        for (const auto& obj : objects) {
+            saveShape(file, obj);
+        }
+
+        file.close();
+    }
+}
+
+// Reads one shape, or a whole group, placed relative to (ox, oy);
+// nullptr for an unknown type or at the end of the file
+Shape* loadShape(std::ifstream& file, int ox, int oy) {
+    std::string line;
+    if (!std::getline(file, line)) return nullptr;
+    std::istringstream iss(line);
+    std::string objectType;
+    iss >> objectType;
+
+    if (objectType == "Group") {
+        int x = 0, y = 0, count = 0;
+        iss >> x >> y >> count;
+        Group* group = new Group(ox + x, oy + y, COLOR);
+        group->hide();
+        for (int i = 0; i < count; i++) {
+            if (Shape* part = loadShape(file, ox + x, oy + y)) group->add(part);
+        }
+        return group;
+    }
+
+    int x, y, size, color, angle = 0;
+    iss >> x >> y >> size >> color >> angle;   // no angle in older files
+
+    Shape* shape = makeShape(objectType, ox + x, oy + y, size, color);
+    if (shape != nullptr && angle != 0) {
+        shape->hide();
+        shape->rotate(angle);
+    }
+    return shape;
+}
+
+void loadScene(std::vector<Shape*>& objects, const std::string& filename) {
+    std::ifstream file(filename);
+
+    if (file.is_open()) {
+        while (!file.eof()) {
+            Shape* shape = loadShape(file, 0, 0);
+            if (shape != nullptr) {
+                objects.push_back(shape);
+            }
+        }
+        file.close();
+    }
+}
+
+std::string SFile() {
 
     std::string filename;
     std::cin.clear();
     SetConsoleCP(1251);
     SetConsoleOutputCP(1251);
+    clearConsoleLine(0);
     std::cout << "    : ";
     std::getline(std::cin, filename);
     clearConsoleLine(0);
     std::cin.ignore(32767, '\n');
     std::cin.clear();
-    std::ofstream file(filename);
-
-    if (file.is_open()) {
-        for (const auto& obj : objects) {
-            file << obj->getType() << " "
-                << obj->getX() << " "
-                << obj->getY() << " "
-                << obj->getSize() << " "
-                << obj->getColor() << " \n";
-        }
-
-        file.close();
-    }
 
     SetConsoleCP(866);
     SetConsoleOutputCP(866);
+    return filename;
 }
 
-void RFile(std::vector<Shape*>& objects) {
-    for (const auto& obj : objects)
-    {
-        obj->hide();
-    }
-
+std::string RFile() {
     std::string filename;
     std::cin.clear();
     SetConsoleCP(1251);
     SetConsoleOutputCP(1251);
+    clearConsoleLine(0);
     std::cout << "    : ";
     std::getline(std::cin, filename);
     clearConsoleLine(0);
     std::cin.clear();
-    std::ifstream file(filename);
+    return filename;
+}
 
-    if (file.is_open()) {
-        std::string line;
-        while (std::getline(file, line)) {
-            std::istringstream iss(line);
-            std::string objectType;
-            iss >> objectType;
+void trajectory(std::vector <int>& t, const char step)
+{
+    if (step == UP) { t.push_back(0); return;}
+    if (step == DOWN) { t.push_back(1); return; }
+    if (step == LEFT) { t.push_back(2); return; }
+    if (step == RIGHT) { t.push_back(3); return; }
+}
 
+// Motion script: a coroutine yielding the displacement of its shape for
+// each frame. The frame is allocated once when the script starts, from a
+// free list, and resuming it does not allocate.
+class Motion
+{
+public:
+    struct promise_type
+    {
+        Grfx::Point step;
 
-            int x, y, size, color;
-            iss >> x >> y >> size >> color;
+        Motion get_return_object() { return Motion(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(Grfx::Point d) { step = d; return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
 
-            if (objectType == "Segment") {
-                objects.push_back(new Segment(x, y, size, size, color));
-            }
-            else if (objectType == "Circle") {
-                objects.push_back(new Circle(x, y, size, color));
+        // Freed frames are kept by size, 64-byte classes, for the next script
+        struct FramePool
+        {
+            std::vector<std::vector<void*>> classes;
+
+            ~FramePool() {
+                for (auto& frames : classes) {
+                    for (void* frame : frames) ::operator delete(frame);
+                }
             }
-            else if (objectType == "Square") {
-                objects.push_back(new Square(x, y, size, color));
+        };
+
+        static std::vector<void*>& freeFrames(size_t size) {
+            static FramePool pool;
+            size_t index = (size + 63) / 64;
+            if (pool.classes.size() <= index) pool.classes.resize(index + 1);
+            return pool.classes[index];
+        }
+
+        static void* operator new(size_t size) {
+            std::vector<void*>& frames = freeFrames(size);
+            if (frames.empty()) return ::operator new((size + 63) / 64 * 64);
+            void* frame = frames.back();
+            frames.pop_back();
+            return frame;
+        }
+
+        static void operator delete(void* frame, size_t size) {
+            freeFrames(size).push_back(frame);
+        }
+    };
+
+    explicit Motion(std::coroutine_handle<promise_type> h) : handle(h) {}
+    Motion(Motion&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+    Motion& operator=(Motion&& other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    Motion(const Motion&) = delete;
+    Motion& operator=(const Motion&) = delete;
+    ~Motion() {
+        if (handle) handle.destroy();
+    }
+
+    // Runs the script to its next step, false once it has finished
+    bool next(Grfx::Point& d) {
+        handle.resume();
+        if (handle.done()) return false;
+        d = handle.promise().step;
+        return true;
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Plays back a path recorded by trajectory()
+Motion replay(std::vector<int> t)
+{
+    for (int code : t) {
+        if (code == 0) co_yield Grfx::Point{ 0, -STEP };
+        if (code == 1) co_yield Grfx::Point{ 0, STEP };
+        if (code == 2) co_yield Grfx::Point{ -STEP, 0 };
+        if (code == 3) co_yield Grfx::Point{ STEP, 0 };
+    }
+}
+
+// Advances every attached motion script by one step per frame
+class Animator
+{
+    struct Task
+    {
+        Shape* shape;
+        Motion motion;
+        Grfx::Point step;
+    };
+    std::vector<Task> tasks;
+    std::vector<Box> vacated;   // reused every frame
+
+public:
+    void attach(Shape* shape, Motion motion) {
+        tasks.push_back({ shape, std::move(motion) });
+    }
+
+    void detach(Shape* shape) {
+        tasks.erase(std::remove_if(tasks.begin(), tasks.end(),
+            [shape](const Task& task) { return task.shape == shape; }), tasks.end());
+    }
+
+    bool running(Shape* shape) const {
+        return std::any_of(tasks.begin(), tasks.end(),
+            [shape](const Task& task) { return task.shape == shape; });
+    }
+
+    bool empty() const { return tasks.empty(); }
+
+    void step() {
+        size_t kept = 0;
+        for (size_t i = 0; i < tasks.size(); i++) {
+            if (!tasks[i].motion.next(tasks[i].step)) continue;
+            if (kept != i) tasks[kept] = std::move(tasks[i]);
+            kept++;
+        }
+        tasks.erase(tasks.begin() + kept, tasks.end());
+
+        // All moving shapes are hidden before any is shown again, so shapes
+        // moving in the same frame do not redraw each other in between
+        vacated.clear();
+        for (Task& task : tasks) {
+            if (task.step.x == 0 && task.step.y == 0) continue;
+            vacated.push_back(task.shape->box());
+            task.shape->hide(false);
+        }
+        if (rendering) {
+            for (const Box& box : vacated) {
+                sweep_and_prune.forEachIn(box, [](Shape* other) {
+                    if (other->isVisible()) other->show();
+                });
             }
-            else if (objectType == "Rockstar") {
-                objects.push_back(new Rockstar(x, y, size, color));
+        }
+        for (Task& task : tasks) {
+            if (task.step.x == 0 && task.step.y == 0) continue;
+            task.shape->translate(task.step.x, task.step.y);
+            task.shape->show();
+        }
+    }
+};
+
+
+class CommandReader
+{
+    const char* p;
+    const char* end;
+    int line = 0;
+
+    void skipBlanks() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    }
+
+    void skipLine() {
+        while (p < end && *p != '\n') p++;
+        if (p < end) p++;
+    }
+
+    bool word(const char*& w, size_t& len) {
+        skipBlanks();
+        w = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+        len = p - w;
+        return len > 0;
+    }
+
+    bool number(int& value) {
+        skipBlanks();
+        bool negative = p < end && *p == '-';
+        if (negative || (p < end && *p == '+')) p++;
+        if (p == end || *p < '0' || *p > '9') return false;
+        value = 0;
+        while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+        if (negative) value = -value;
+        return true;
+    }
+
+    bool numbers(int* values, int n) {
+        for (int i = 0; i < n; i++) {
+            if (!number(values[i])) return false;
+        }
+        return true;
+    }
+
+    static bool is(const char* w, size_t len, const char* keyword) {
+        return strlen(keyword) == len && memcmp(w, keyword, len) == 0;
+    }
+
+    bool parse(Command& cmd) {
+        const char* w;
+        size_t len;
+        if (!word(w, len)) return false;
+
+        if (is(w, len, "move")) { cmd.op = Command::MOVE; return numbers(cmd.args, 2); }
+        if (is(w, len, "select")) { cmd.op = Command::SELECT; return numbers(cmd.args, 1); }
+        if (is(w, len, "recolor")) { cmd.op = Command::RECOLOR; return numbers(cmd.args, 1); }
+        if (is(w, len, "resize")) { cmd.op = Command::RESIZE; return numbers(cmd.args, 1); }
+        if (is(w, len, "rotate")) { cmd.op = Command::ROTATE; return numbers(cmd.args, 1); }
+        if (is(w, len, "group")) { cmd.op = Command::GROUP; return numbers(cmd.args, 2); }
+        if (is(w, len, "ungroup")) { cmd.op = Command::UNGROUP; return true; }
+        if (is(w, len, "hide")) { cmd.op = Command::HIDE; return true; }
+        if (is(w, len, "show")) { cmd.op = Command::SHOW; return true; }
+        if (is(w, len, "clear")) { cmd.op = Command::CLEAR; return true; }
+        if (is(w, len, "add")) {
+            cmd.op = Command::ADD;
+            if (!word(w, len)) return false;
+            cmd.text.assign(w, len);
+            return numbers(cmd.args, 4);
+        }
+        if (is(w, len, "trail")) {
+            cmd.op = Command::TRAIL;
+            if (!word(w, len)) return false;
+            cmd.args[0] = is(w, len, "off") ? 0 : is(w, len, "on") ? 1 : 2;
+            return cmd.args[0] != 2 || is(w, len, "toggle");
+        }
+        if (is(w, len, "save") || is(w, len, "load")) {
+            cmd.op = *w == 's' ? Command::SAVE : Command::LOAD;
+            skipBlanks();
+            w = p;
+            while (p < end && *p != '\r' && *p != '\n') p++;
+            cmd.text.assign(w, p - w);
+            return !cmd.text.empty();
+        }
+        return false;
+    }
+
+public:
+    CommandReader(const char* begin, const char* finish) : p(begin), end(finish) {}
+
+    // Reads the next command, false at the end of input. Malformed lines are reported and skipped.
+    bool next(Command& cmd) {
+        while (p < end) {
+            line++;
+            skipBlanks();
+            if (p == end || *p == '\n' || *p == '#') {
+                skipLine();
+                continue;
             }
-            else if (objectType == "Star") {
-                objects.push_back(new Star(x, y, size, 2 * size / 3, color));
+            bool ok = parse(cmd);
+            skipBlanks();
+            ok = ok && (p == end || *p == '\n');
+            skipLine();
+            if (ok) return true;
+            std::cerr << "line " << line << ": bad command" << std::endl;
+        }
+        return false;
+    }
+};
+
+void execute(const Command& cmd, std::vector<Shape*>& objects, int& iter) {
+    switch (cmd.op) {
+    case Command::ADD:
+        if (Shape* shape = makeShape(cmd.text, cmd.args[0], cmd.args[1], cmd.args[2], cmd.args[3])) {
+            objects.push_back(shape);
+            iter = int(objects.size() - 1);
+        }
+        return;
+    case Command::SELECT:
+        if (cmd.args[0] >= 1 && cmd.args[0] <= int(objects.size())) iter = cmd.args[0] - 1;
+        return;
+    case Command::GROUP: {
+        int first = cmd.args[0] - 1, last = cmd.args[1] - 1;
+        if (first < 0 || first > last || last >= int(objects.size())) return;
+        Group* group = new Group(objects[first]->getX(), objects[first]->getY(), objects[first]->getColor());
+        group->hide();
+        group->add(std::vector<Shape*>(objects.begin() + first, objects.begin() + last + 1));
+        objects.erase(objects.begin() + first, objects.begin() + last + 1);
+        objects.insert(objects.begin() + first, group);
+        iter = first;
+        group->show();
+        return;
+    }
+    case Command::CLEAR:
+        trail_store.clear();
+        console_graphics.clear(Grfx::TRAILS);
+        console_graphics.clear(Grfx::OVERLAY);
+        return;
+    case Command::SAVE:
+        saveScene(objects, cmd.text);
+        return;
+    case Command::LOAD: {
+        size_t loaded = objects.size();
+        loadScene(objects, cmd.text);
+        for (size_t i = loaded; i < objects.size(); i++) {
+            objects[i]->show();
+        }
+        return;
+    }
+    default:
+        break;
+    }
+
+    if (objects.empty()) return;
+    Shape* shape = objects.at(iter);
+    switch (cmd.op) {
+    case Command::MOVE:
+        shape->move(cmd.args[0], cmd.args[1]);
+        break;
+    case Command::RECOLOR:
+        shape->setColor(cmd.args[0]);
+        shape->show();
+        break;
+    case Command::RESIZE:
+        shape->hide();
+        shape->resize(cmd.args[0]);
+        shape->show();
+        break;
+    case Command::ROTATE:
+        shape->hide();
+        shape->rotate(cmd.args[0]);
+        shape->show();
+        break;
+    case Command::UNGROUP:
+        if (Group* group = dynamic_cast<Group*>(shape)) {
+            group->hide();
+            std::vector<Shape*> parts = group->release();
+            delete group;
+            objects.erase(objects.begin() + iter);
+            objects.insert(objects.begin() + iter, parts.begin(), parts.end());
+            for (Shape* part : parts) {
+                part->show();
             }
+            if (objects.empty()) iter = 0;
+            else iter = (std::min)(iter, int(objects.size()) - 1);
         }
-        file.close();
+        break;
+    case Command::TRAIL:
+        shape->SetTrail(cmd.args[0] == 2 ? !shape->getDrawTrail() : cmd.args[0] == 1);
+        break;
+    case Command::HIDE:
+        shape->hide();
+        break;
+    case Command::SHOW:
+        shape->show();
+        break;
+    default:
+        break;
     }
+}
 
-    
-    for (const auto& obj : objects)
-    {
-        obj->show();
+// Runs a command stream with drawing switched off; returns the number of commands
+long long runBatch(std::istream& in, std::vector<Shape*>& objects, int& iter) {
+    std::string script((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    CommandReader reader(script.data(), script.data() + script.size());
+    Command cmd;
+    long long count = 0;
+
+    rendering = false;
+    while (reader.next(cmd)) {
+        execute(cmd, objects, iter);
+        count++;
     }
+    rendering = true;
+    return count;
 }
 
-void trajectory(std::vector <int>& t, const char step)
-{
-    if (step == UP) { t.push_back(0); return;}
-    if (step == DOWN) { t.push_back(1); return; }
-    if (step == LEFT) { t.push_back(2); return; }
-    if (step == RIGHT) { t.push_back(3); return; }
+// Draws the whole scene from scratch, e.g. after a batch ran without drawing
+void redrawScene(const std::vector<Shape*>& objects) {
+    console_graphics.cls();
+    for (Shape* obj : objects) {
+        obj->showTrail();
+        if (obj->isVisible()) obj->show();
+    }
+    console_graphics.flush();
 }
 
-char trajectory2(const std::vector <int>& t,const int i)
+// Bounded single-producer single-consumer ring. Each index is written by
+// one side only, so neither side ever takes a lock.
+template <class T, size_t N>
+class SpscQueue
 {
-    if (t[i] == 0) return UP;
-    if (t[i] == 1) return DOWN;
-    if (t[i] == 2) return LEFT;
-    if (t[i] == 3) return RIGHT;
-    return _getch();
-}
+    static_assert((N & (N - 1)) == 0, "capacity must be a power of two");
+
+    T slots[N];
+    alignas(64) std::atomic<size_t> head{ 0 };   // next slot to read, consumer
+    alignas(64) std::atomic<size_t> tail{ 0 };   // next slot to write, producer
+
+public:
+    // Moves the value in, false if the queue is full
+    bool push(T& value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) return false;
+        slots[t & (N - 1)] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        tail.notify_one();
+        return true;
+    }
+
+    bool pop(T& value) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        value = std::move(slots[h & (N - 1)]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side: blocks while the queue is empty
+    void wait() {
+        tail.wait(head.load(std::memory_order_relaxed), std::memory_order_acquire);
+    }
+};
+
+// Owns the scene in interactive mode. The input thread only posts commands;
+// this thread applies everything pending, then draws a single frame, so a
+// slow frame delays drawing but never the handling of keys.
+class Renderer
+{
+    std::vector<Shape*>& objects;
+    int& iter;
+    Animator animator;
+    SpscQueue<Command, 256> queue;
+    size_t posted = 0;                  // input thread only
+    std::atomic<size_t> applied{ 0 };
+    std::atomic<int> shapes;
+    Shape* moving = nullptr;            // shape of the pending moves, drawn once
+    std::string report;                 // text of COLLISIONS and SCREENSIZE, see takeReport()
+    std::thread thread;
+
+    void settle() {
+        if (moving != nullptr) moving->show();
+        moving = nullptr;
+    }
+
+    void apply(const Command& cmd) {
+        // Consecutive moves of the selected shape hide and show it only once;
+        // every step still goes to its trail
+        if (cmd.op == Command::MOVE && !objects.empty()) {
+            if (moving == nullptr) {
+                moving = objects.at(iter);
+                moving->hide();
+            }
+            moving->translate(cmd.args[0], cmd.args[1]);
+            return;
+        }
+        settle();
+
+        switch (cmd.op) {
+        case Command::OVERLAY:
+            // Backdrop on the overlay layer keeps the text readable without touching shapes or trails
+            if (cmd.args[0]) {
+                console_graphics.setlayer(Grfx::OVERLAY);
+                console_graphics.setcolor(0);
+                console_graphics.bar(0, 0, console_graphics.hSize() - 1, console_graphics.vSize() - 1);
+                console_graphics.setlayer(Grfx::SHAPES);
+            }
+            else {
+                console_graphics.clear(Grfx::OVERLAY);
+                // the menu text has been cleared off the terminal
+                console_graphics.redrawterminal();
+            }
+            break;
+
+        case Command::GROUP:
+            // parts move with the group now, so their own scripts stop
+            for (int i = cmd.args[0] - 1; i >= 0 && i < cmd.args[1] && i < int(objects.size()); i++) {
+                animator.detach(objects[i]);
+            }
+            execute(cmd, objects, iter);
+            break;
+
+        case Command::UNGROUP:
+            if (!objects.empty()) animator.detach(objects.at(iter));
+            execute(cmd, objects, iter);
+            break;
+
+        case Command::PAN:
+            console_graphics.setview(console_graphics.getviewx() + cmd.args[0], console_graphics.getviewy() + cmd.args[1]);
+            break;
+
+        case Command::ANIMATE:
+            if (objects.empty()) break;
+            if (animator.running(objects.at(iter))) { animator.detach(objects.at(iter)); break; }
+            if (!cmd.text.empty()) animator.attach(objects.at(iter), replay(std::vector<int>(cmd.text.begin(), cmd.text.end())));
+            break;
+
+        case Command::COLLISIONS: {
+            std::ostringstream text;
+            text << ":";
+            for (const auto& pair : findCollisions()) {
+                text << ' ' << std::find(objects.begin(), objects.end(), pair.first) - objects.begin() + 1
+                    << '-' << std::find(objects.begin(), objects.end(), pair.second) - objects.begin() + 1;
+            }
+            report = text.str();
+            break;
+        }
+
+        case Command::SCREENSIZE:
+            report = std::to_string(console_graphics.hSize()) + ' ' + std::to_string(console_graphics.vSize());
+            break;
+
+        default:
+            execute(cmd, objects, iter);
+            break;
+        }
+    }
+
+    void run() {
+        const auto frame = std::chrono::milliseconds(FRAME);
+        auto next = std::chrono::steady_clock::now();
+        bool quit = false;
+        Command cmd;
+
+        // the starting scene is on screen before the first key
+        console_graphics.flush();
+
+        while (!quit) {
+            // Idle until a command arrives; while motion scripts run, wake once per frame
+            if (animator.empty()) {
+                queue.wait();
+                next = std::chrono::steady_clock::now();
+            }
+            else {
+                std::this_thread::sleep_until(next);
+                next = (std::max)(next + frame, std::chrono::steady_clock::now());
+            }
+
+            size_t count = 0;
+            while (!quit && queue.pop(cmd)) {
+                count++;
+                if (cmd.op == Command::QUIT) quit = true;
+                else apply(cmd);
+            }
+            settle();
+            if (!animator.empty()) animator.step();
+            trail_store.repaint();
+
+            if (!objects.empty()) {
+                objects.at(iter)->show();
+            }
+            console_graphics.flush();
+
+            shapes.store(int(objects.size()), std::memory_order_relaxed);
+            applied.fetch_add(count, std::memory_order_release);
+            applied.notify_all();
+        }
+    }
+
+public:
+    Renderer(std::vector<Shape*>& scene, int& selected)
+        : objects(scene), iter(selected), shapes(int(scene.size())) {
+        thread = std::thread(&Renderer::run, this);
+    }
+
+    ~Renderer() {
+        stop();
+    }
+
+    // Applies what is still queued and ends the render thread
+    void stop() {
+        if (!thread.joinable()) return;
+        post(Command{ Command::QUIT });
+        thread.join();
+    }
+
+    // Input thread side. Waits only if the render thread is a whole queue behind.
+    void post(Command cmd) {
+        while (!queue.push(cmd)) std::this_thread::yield();
+        posted++;
+    }
+
+    // Waits until every posted command has been applied and drawn,
+    // e.g. before a prompt that needs the scene as the user sees it
+    void sync() {
+        size_t done = applied.load(std::memory_order_acquire);
+        while (done < posted) {
+            applied.wait(done, std::memory_order_acquire);
+            done = applied.load(std::memory_order_acquire);
+        }
+    }
+
+    // Number of shapes as of the last frame
+    int count() const { return shapes.load(std::memory_order_relaxed); }
 
+    // The console belongs to the input thread, so queries leave their text
+    // here for it to print after sync()
+    std::string takeReport() { return std::exchange(report, std::string()); }
+};
 
-int main() {
+int main(int argc, char* argv[]) {
         
     std::vector<Shape*> objects;
     objects.push_back(new Segment(200, 200, 100, 100, COLOR));
@@ -713,11 +2270,60 @@ int main() {
     std::vector <int> t;
 
     setlocale(LC_ALL, "russian");
-
-    int iter = 0, i = 0;
-    bool tr1 = false, tr2 = false;
+    console_graphics.setcanvas(CANVAS, CANVAS);
+
+    int iter = 0;
+
+    // --batch <file or -> [--render]: run a command script, then either
+    // quit or draw the resulting scene once and continue interactively
+    // --term blocks|braille|off: draw as text in the terminal, see Grfx::Graphics::setterminal()
+    const char* script = nullptr;
+    bool render = false;
+#ifdef _WIN32
+    Grfx::Terminal term = Grfx::TERM_OFF;
+#else
+    // there is no console window to draw in
+    Grfx::Terminal term = Grfx::TERM_BLOCKS;
+#endif
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--batch") == 0 && a + 1 < argc) script = argv[++a];
+        else if (strcmp(argv[a], "--render") == 0) render = true;
+        else if (strcmp(argv[a], "--shm") == 0 && a + 1 < argc) {
+            // frames also go to a shared memory segment for external viewers
+            const char* name = argv[++a];
+            if (!console_graphics.share(name)) std::cerr << "cannot share frames as " << name << std::endl;
+        }
+        else if (strcmp(argv[a], "--term") == 0 && a + 1 < argc) {
+            const char* mode = argv[++a];
+            if (strcmp(mode, "braille") == 0) term = Grfx::TERM_BRAILLE;
+            else if (strcmp(mode, "off") == 0) term = Grfx::TERM_OFF;
+            else term = Grfx::TERM_BLOCKS;
+        }
+    }
+    if (term != Grfx::TERM_OFF) console_graphics.setterminal(term);
+    if (script != nullptr) {
+        std::ifstream file;
+        if (strcmp(script, "-") != 0) file.open(script, std::ios::binary);
+        std::istream& in = strcmp(script, "-") == 0 ? std::cin : file;
+
+        auto start = std::chrono::steady_clock::now();
+        long long count = runBatch(in, objects, iter);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << count << " commands in " << elapsed.count() << " s" << std::endl;
+
+        if (!render) {
+            for (Shape* obj : objects) {
+                delete obj;
+            }
+            return 0;
+        }
+        redrawScene(objects);
+    }
+    bool tr1 = false;
     char c = 0;
 
+    Renderer renderer(objects, iter);
+
     while (c != 27)
     {      
         /*if (GetAsyncKeyState(VK_LEFT) & 0x8000) objects.at(iter)->move(-STEP, 0);
@@ -730,51 +2336,58 @@ int main() {
             trajectory(t, c);
         }
 
-        if (tr2)
-        {
-            c = trajectory2(t, i);
-            if (i == t.size() - 1) {
-                trajectory2(t, i);
-                tr2 = false;
-                i = 0;
-                c = _getch();
-            }
-            else i++;
-        }
-        else
-        {
-            c = _getch();
-        }
+        c = _getch();
 
+        Command cmd{};
         switch (c)
         {
         case UP:
-            objects.at(iter)->move(0, -STEP);
+            renderer.post(Command{ Command::MOVE, { 0, -STEP } });
             break;
         case DOWN:
-            objects.at(iter)->move(0, STEP);
+            renderer.post(Command{ Command::MOVE, { 0, STEP } });
             break;
         case LEFT:
-            objects.at(iter)->move(-STEP, 0);
+            renderer.post(Command{ Command::MOVE, { -STEP, 0 } });
             break;
         case RIGHT:
-            objects.at(iter)->move(STEP, 0);
+            renderer.post(Command{ Command::MOVE, { STEP, 0 } });
+            break;
+
+        case PAN_UP:
+            renderer.post(Command{ Command::PAN, { 0, -PAN } });
+            break;
+        case PAN_DOWN:
+            renderer.post(Command{ Command::PAN, { 0, PAN } });
+            break;
+        case PAN_LEFT:
+            renderer.post(Command{ Command::PAN, { -PAN, 0 } });
+            break;
+        case PAN_RIGHT:
+            renderer.post(Command{ Command::PAN, { PAN, 0 } });
             break;
 
         case MENU:
-            menu(objects);
+            renderer.post(Command{ Command::OVERLAY, { 1 } });
+            renderer.sync();
+            menu();
+            renderer.post(Command{ Command::OVERLAY, { 0 } });
             break;
 
         case ChangeColor:
-            Recolor(objects.at(iter));
+            renderer.post(Command{ Command::RECOLOR, { Recolor() } });
             break;
 
         case Showobject:
-            objects.at(iter)->show();
+            renderer.post(Command{ Command::SHOW });
             break;
 
         case ChangeSize:            
-            resizeObject(objects.at(iter));
+            renderer.post(Command{ Command::RESIZE, { resizeObject() } });
+            break;
+
+        case Rotate:
+            renderer.post(Command{ Command::ROTATE, { TURN_STEP } });
             break;
 
         case TRAJ:
@@ -784,43 +2397,63 @@ int main() {
             break;
 
         case TRAJ2:
-            if (tr2 == false) { tr2 = true; break; }
-            tr2 = false;
+            cmd.op = Command::ANIMATE;
+            cmd.text.assign(t.begin(), t.end());
+            renderer.post(cmd);
             break;
 
         case SaveToFile:
-            SFile(objects);
+            renderer.post(Command{ Command::SAVE, {}, SFile() });
             break;
 
         case ReadFromFile:
-            RFile(objects);
+            renderer.post(Command{ Command::LOAD, {}, RFile() });
             break;
         case Hideobject:
-            objects.at(iter)->hide();
+            renderer.post(Command{ Command::HIDE });
             break;
 
         case ClearScreen:
-            console_graphics.cls();
+            renderer.post(Command{ Command::CLEAR });
             break;
 
         case ShapeTrail:
-            
-            if (!objects.empty()) {
-                objects.at(iter)->toggleTrail();
-            }
+            renderer.post(Command{ Command::TRAIL, { 2 } });
+            break;
+
+        case Collisions:
+            renderer.post(Command{ Command::COLLISIONS });
+            renderer.sync();
+            clearConsoleLine(0);
+            std::cout << renderer.takeReport() << std::endl;
             break;
 
         case ScreenSize:
-            std::cout << console_graphics.hSize() << ' ' << console_graphics.vSize() << std::endl;
+            renderer.post(Command{ Command::SCREENSIZE });
+            renderer.sync();
+            clearConsoleLine(0);
+            std::cout << renderer.takeReport() << std::endl;
             break;
 
         case AddObject:
-            addObject(objects);
-            iter++;
+            if (addObject(cmd)) renderer.post(cmd);
+            break;
+
+        case GroupObjects:
+            renderer.sync();
+            cmd.op = Command::GROUP;
+            cmd.args[0] = switchObject(renderer.count()) + 1;
+            cmd.args[1] = switchObject(renderer.count()) + 1;
+            renderer.post(cmd);
+            break;
+
+        case UngroupObject:
+            renderer.post(Command{ Command::UNGROUP });
             break;
 
         case ChangeObject:
-            iter = switchObject(objects);
+            renderer.sync();
+            renderer.post(Command{ Command::SELECT, { switchObject(renderer.count()) + 1 } });
             break;
 
         default:
@@ -828,13 +2461,10 @@ int main() {
             c = _getch();
             break;
         }
-
-        
-        if (!objects.empty()) {
-            objects.at(iter)->show();
-        }
     }
 
+    renderer.stop();
+
     
     for (Shape* obj : objects) {
         delete obj;
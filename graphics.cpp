@@ -7,6 +7,7 @@ using namespace Grfx;
 
    Graphics::Graphics()
    {
+#ifdef _WIN32
 	//  
         // Initialize GDI+.
         Gdiplus::GdiplusStartupInput gdiplusStartupInput;
@@ -24,57 +25,875 @@ using namespace Grfx;
         
         Gdiplus::Color blackColor(255, 0, 0, 0);
         gr->Clear(blackColor);
+#else
+        // no console window; frames reach the terminal, see setterminal()
+        sz.Width = 1024;
+        sz.Height = 768;
+#endif
+        color = 0xFF000000;
+        layer = SHAPES;
+        capturing = false;
+        overlayUsed = false;
+        canvasW = canvasH = 0;
+        viewX = viewY = 0;
+        frames = 0;
+        shared = nullptr;
+        hotTiles = 0;
+        tileLimit = 64 * 1024 * 1024;
+        for (int l = 0; l < OVERLAY; l++)
+           recent[l] = nullptr;
+        term = TERM_OFF;
+        termCols = termRows = cols = rows = top = 0;
         // 2017-04-07 12:21 alkhizha
         windowSize();
 
    }
    Graphics::~Graphics()
    {
+        unshare();
+        // leave the cursor below the picture
+        if (term != TERM_OFF && std::any_of(cells.begin(), cells.end(), [](const Cell & c) { return c.glyph != 0; }))
+           printf("\x1b[0m\x1b[%d;1H\n", top + rows);
+#ifdef _WIN32
 	delete gr;
         Gdiplus::GdiplusShutdown(gdiplusToken);
 	ReleaseDC(hWnd, hDC);
+#endif
    }	
 
    void Graphics::setcolor(int c)
    {
-        BYTE byRed = 0, byGreen = 0, byBlue = 0;
+        if (c == ERASE)
+        {
+            color = 0;
+            return;
+        }
+        uint8_t byRed = 0, byGreen = 0, byBlue = 0;
         byRed = 255*(c&0x4);
         byGreen = 255*(c&0x2);
         byBlue = 255*(c&0x1);
-        color = Gdiplus::Color(255, byRed, byGreen, byBlue);
+        color = 0xFF000000u | (uint32_t(byRed) << 16) | (uint32_t(byGreen) << 8) | byBlue;
+   }
+
+   // Window coordinates; the part outside the window is dropped
+   void Graphics::markDirty(int x, int y, int x2, int y2)
+   {
+       x = (std::max)(x, 0);
+       y = (std::max)(y, 0);
+       x2 = (std::min)(x2, sz.Width - 1);
+       y2 = (std::min)(y2, sz.Height - 1);
+       if (x > x2 || y > y2) return;
+       if (x < dirtyX) dirtyX = x;
+       if (y < dirtyY) dirtyY = y;
+       if (x2 > dirtyX2) dirtyX2 = x2;
+       if (y2 > dirtyY2) dirtyY2 = y2;
+   }
+
+   // Finds the tile of a canvas layer, unpacking it if it went cold. A tile
+   // is created only when asked to, so erasing never allocates.
+   Graphics::Tile * Graphics::tile(int l, int tx, int ty, bool create)
+   {
+       uint64_t key = (uint64_t(ty) << 32) | uint32_t(tx);
+       Tile * t = recent[l];
+       if (t == nullptr || recentKey[l] != key)
+       {
+           auto it = tiles[l].find(key);
+           if (it != tiles[l].end()) t = &it->second;
+           else if (create)
+           {
+               t = &tiles[l][key];
+               t->pixels.assign(TILE * TILE, l == BACKGROUND ? 0xFF000000u : 0u);
+               hotTiles++;
+           }
+           else return nullptr;
+           recent[l] = t;
+           recentKey[l] = key;
+       }
+       if (t->pixels.empty()) unpack(*t);
+       t->used = frames;
+       return t;
+   }
+
+   void Graphics::pack(Tile & t)
+   {
+       t.packed.clear();
+       for (int i = 0; i < TILE * TILE; )
+       {
+           int j = i + 1;
+           while (j < TILE * TILE && t.pixels[j] == t.pixels[i]) j++;
+           t.packed.push_back(uint32_t(j - i));
+           t.packed.push_back(t.pixels[i]);
+           i = j;
+       }
+       t.packed.shrink_to_fit();
+       std::vector<uint32_t>().swap(t.pixels);
+       hotTiles--;
+   }
+
+   void Graphics::unpack(Tile & t)
+   {
+       t.pixels.resize(TILE * TILE);
+       uint32_t * p = t.pixels.data();
+       for (size_t i = 0; i < t.packed.size(); i += 2)
+           p = std::fill_n(p, t.packed[i], t.packed[i + 1]);
+       std::vector<uint32_t>().swap(t.packed);
+       hotTiles++;
+   }
+
+   // Packs the least recently used tiles until a quarter of the budget is
+   // free again, so the scan over all tiles is paid rarely. Tiles that hold
+   // nothing but the layer's blank pixel are dropped instead.
+   void Graphics::evictTiles()
+   {
+       size_t limit = tileLimit / (TILE * TILE * sizeof(uint32_t));
+       if (hotTiles <= limit) return;
+       std::vector<std::pair<uint64_t, std::pair<int, uint64_t>>> hot;
+       for (int l = 0; l < OVERLAY; l++)
+           for (auto & kv : tiles[l])
+               if (!kv.second.pixels.empty())
+                   hot.push_back({ kv.second.used, { l, kv.first } });
+       size_t count = hotTiles - limit * 3 / 4;
+       std::nth_element(hot.begin(), hot.begin() + (count - 1), hot.end());
+       for (size_t i = 0; i < count; i++)
+       {
+           int l = hot[i].second.first;
+           auto it = tiles[l].find(hot[i].second.second);
+           pack(it->second);
+           uint32_t blank = l == BACKGROUND ? 0xFF000000u : 0u;
+           if (it->second.packed.size() == 2 && it->second.packed[1] == blank)
+               tiles[l].erase(it);
+       }
+       for (int l = 0; l < OVERLAY; l++)
+           recent[l] = nullptr;
+   }
+
+   // Splits a run of pixels of the current layer at tile edges and calls
+   // f(dst, x, n) for each piece: n pixels from x, stored from dst on.
+   // Without create, pieces on tiles never drawn on are skipped.
+   template <class F>
+   void Graphics::pieces(int x, int x2, int y, bool create, F f)
+   {
+       if (layer == OVERLAY)
+       {
+           if (y < 0 || y >= sz.Height) return;
+           x = (std::max)(x, 0);
+           x2 = (std::min)(x2, sz.Width - 1);
+           if (x > x2) return;
+           f(&overlay[size_t(y) * sz.Width + x], x, x2 - x + 1);
+           overlayUsed = true;
+           return;
+       }
+       if (y < 0 || y >= canvasH) return;
+       x = (std::max)(x, 0);
+       x2 = (std::min)(x2, canvasW - 1);
+       while (x <= x2)
+       {
+           int tx = x / TILE, end = (std::min)(x2, tx * TILE + TILE - 1);
+           if (Tile * t = tile(layer, tx, y / TILE, create))
+               f(&t->pixels[(y % TILE) * TILE + x % TILE], x, end - x + 1);
+           x = end + 1;
+       }
+   }
+
+   void Graphics::setlayer(Layer l)
+   {
+       layer = l;
+   }
+
+   // All primitives end up here: one horizontal run of pixels in the current colour
+   void Graphics::span(int x, int x2, int y)
+   {
+       if (x > x2) std::swap(x, x2);
+       if (capturing)
+       {
+           captured.push_back({ x - captureX, x2 - captureX, y - captureY, color });
+           return;
+       }
+       // the background stays opaque, erasing it paints black
+       uint32_t ink = layer == BACKGROUND ? (color | 0xFF000000u) : color;
+       bool blank = ink == (layer == BACKGROUND ? 0xFF000000u : 0u);
+       pieces(x, x2, y, !blank, [ink](uint32_t * dst, int, int n) { std::fill_n(dst, n, ink); });
+       if (layer == OVERLAY) markDirty(x, y, x2, y);
+       else markDirty(x - viewX, y - viewY, x2 - viewX, y - viewY);
+   }
+
+   void Graphics::plot(int x, int y)
+   {
+       span(x, x, y);
    }
 
    void Graphics::line(int x, int y, int x2, int y2)
    {
-       Gdiplus::Pen      pen  (color);
-       gr->DrawLine(&pen, x, y, x2, y2);
+       if (y == y2) { span(x, x2, y); return; }
+       // Bresenham
+       int dx = abs(x2 - x), sx = x < x2 ? 1 : -1;
+       int dy = -abs(y2 - y), sy = y < y2 ? 1 : -1;
+       int err = dx + dy;
+       for (;;)
+       {
+           plot(x, y);
+           if (x == x2 && y == y2) break;
+           int e2 = 2 * err;
+           if (e2 >= dy) { err += dy; x += sx; }
+           if (e2 <= dx) { err += dx; y += sy; }
+       }
    }
 
    void Graphics::circle(int x, int y, int r)
    {
-       Gdiplus::Pen      pen  (color);
-       gr->DrawEllipse(&pen, x-r, y-r, r, r);
+       // Same figure as the former DrawEllipse(x-r, y-r, r, r): a circle
+       // of diameter r inscribed in that box
+       int rr = r / 2;
+       int cx = x - r + rr, cy = y - r + rr;
+       // Midpoint circle
+       int px = rr, py = 0, err = 1 - rr;
+       while (px >= py)
+       {
+           plot(cx + px, cy + py); plot(cx - px, cy + py);
+           plot(cx + px, cy - py); plot(cx - px, cy - py);
+           plot(cx + py, cy + px); plot(cx - py, cy + px);
+           plot(cx + py, cy - px); plot(cx - py, cy - px);
+           py++;
+           if (err < 0) err += 2 * py + 1;
+           else { px--; err += 2 * (py - px) + 1; }
+       }
    }
    void Graphics::rectangle(int x, int y, int x2, int y2)
    {
-       Gdiplus::Pen      pen  (color);
-       gr->DrawLine(&pen, x, y, x, y2);
-       gr->DrawLine(&pen, x, y, x2, y);
-       gr->DrawLine(&pen, x2, y, x2, y2);
-       gr->DrawLine(&pen, x, y2, x2, y2);
+       const Point pts[4] = { { x, y }, { x2, y }, { x2, y2 }, { x, y2 } };
+       polygon(pts, 4);
+   }
+   void Graphics::polyline(const Point * pts, int n)
+   {
+       if (n == 1) plot(pts[0].x, pts[0].y);
+       for (int i = 1; i < n; i++)
+           line(pts[i - 1].x, pts[i - 1].y, pts[i].x, pts[i].y);
+   }
+   void Graphics::polygon(const Point * pts, int n)
+   {
+       polyline(pts, n);
+       if (n > 2) line(pts[n - 1].x, pts[n - 1].y, pts[0].x, pts[0].y);
+   }
+   void Graphics::fillpolygon(const Point * pts, int n)
+   {
+       if (n < 3) return;
+       // Edge table: non-horizontal edges bucketed by their top scanline,
+       // x kept in 16.16 fixed point and stepped by the inverse slope
+       struct Edge
+       {
+           int ymax;
+           int64_t x, dxdy;
+       };
+       int ymin = pts[0].y, ymax = pts[0].y;
+       for (int i = 1; i < n; i++)
+       {
+           ymin = (std::min)(ymin, pts[i].y);
+           ymax = (std::max)(ymax, pts[i].y);
+       }
+       std::vector<std::vector<Edge>> table(ymax - ymin + 1);
+       for (int i = 0; i < n; i++)
+       {
+           Point a = pts[i], b = pts[(i + 1) % n];
+           if (a.y == b.y) continue;
+           if (a.y > b.y) std::swap(a, b);
+           int64_t dxdy = int64_t(b.x - a.x) * 65536 / (b.y - a.y);
+           table[a.y - ymin].push_back({ b.y, int64_t(a.x) * 65536 + 32768, dxdy });
+       }
+       // Active edges cover [ytop, ymax) so shared vertices count once
+       std::vector<Edge> active;
+       for (int y = ymin; y < ymax; y++)
+       {
+           for (const Edge & e : table[y - ymin]) active.push_back(e);
+           active.erase(std::remove_if(active.begin(), active.end(),
+                                       [y](const Edge & e) { return e.ymax <= y; }), active.end());
+           std::sort(active.begin(), active.end(),
+                     [](const Edge & a, const Edge & b) { return a.x < b.x; });
+           for (size_t i = 0; i + 1 < active.size(); i += 2)
+               span(int(active[i].x >> 16), int(active[i + 1].x >> 16), y);
+           for (Edge & e : active) e.x += e.dxdy;
+       }
+   }
+   void Graphics::points(const Point * pts, int n, int dot)
+   {
+       for (int i = 0; i < n; i++)
+           for (int row = 0; row < dot; row++)
+               span(pts[i].x, pts[i].x + dot - 1, pts[i].y + row);
+   }
+   void Graphics::bar(int x, int y, int x2, int y2)
+   {
+       if (y > y2) std::swap(y, y2);
+       for (int row = y; row <= y2; row++)
+           span(x, x2, row);
    }
    // 2017-04-01 11:50 alkhizha
    void Graphics:: cls()
    {
-       gr->Clear(Gdiplus::Color(0,0,0,0));
+       for (int l = 0; l < LAYERS; l++)
+           clear(Layer(l));
+   }
+   void Graphics::clear(Layer l)
+   {
+       if (l == OVERLAY)
+       {
+           std::fill(overlay.begin(), overlay.end(), 0u);
+           overlayUsed = false;
+       }
+       else
+       {
+           for (auto & kv : tiles[l])
+               if (!kv.second.pixels.empty()) hotTiles--;
+           tiles[l].clear();
+           recent[l] = nullptr;
+       }
+       invalidate();
    }
    // 2017-04-01 11:50 alkhizha
    void Graphics::windowSize()
    {
+      // a shared frame is replaced by one of the new size
+      bool wasShared = shared != nullptr;
+      if (wasShared) retireShared();
+#ifdef _WIN32
    // Get a bounding rectangle for the clipping region.
       Gdiplus::Rect boundRect;
       gr->GetVisibleClipBounds(&boundRect);
       boundRect.GetSize(&sz);
+#endif
+      overlay.assign(size_t(sz.Width) * sz.Height, 0u);
+      overlayUsed = false;
+      frame.assign(size_t(sz.Width) * sz.Height, 0xFF000000u);
+      pixels = frame.data();
+      if (wasShared && !mapShared()) sharedName.clear();
+      dirtyX = dirtyY = shownX = shownY = INT_MAX;
+      dirtyX2 = dirtyY2 = shownX2 = shownY2 = INT_MIN;
+      // the canvas is never smaller than the window
+      setcanvas(canvasW, canvasH);
+      // the terminal may have been resized too
+      if (term != TERM_OFF) setterminal(term, termCols, termRows);
+      invalidate();
    }
    int Graphics::hSize() { return sz.Width; }
    int Graphics::vSize() { return sz.Height; }
+
+   void Graphics::setcanvas(int w, int h)
+   {
+       canvasW = (std::max)(w, int(sz.Width));
+       canvasH = (std::max)(h, int(sz.Height));
+       // tiles left outside can never be drawn again
+       for (int l = 0; l < OVERLAY; l++)
+       {
+           for (auto it = tiles[l].begin(); it != tiles[l].end(); )
+           {
+               int tx = int(uint32_t(it->first)), ty = int(it->first >> 32);
+               if (tx * TILE < canvasW && ty * TILE < canvasH) { ++it; continue; }
+               if (!it->second.pixels.empty()) hotTiles--;
+               it = tiles[l].erase(it);
+           }
+           recent[l] = nullptr;
+       }
+       setview(viewX, viewY);
+   }
+   int Graphics::canvasWidth() { return canvasW; }
+   int Graphics::canvasHeight() { return canvasH; }
+
+   void Graphics::setview(int x, int y)
+   {
+       x = (std::max)(0, (std::min)(x, canvasW - int(sz.Width)));
+       y = (std::max)(0, (std::min)(y, canvasH - int(sz.Height)));
+       int dx = x - viewX, dy = y - viewY;
+       if (dx == 0 && dy == 0) return;
+       int w = sz.Width, h = sz.Height;
+
+       // bring frame up to date, then scroll what stays visible
+       if (dirtyX <= dirtyX2) composite(dirtyX, dirtyY, dirtyX2, dirtyY2);
+       beginFrame();
+       dirtyX = dirtyY = INT_MAX;
+       dirtyX2 = dirtyY2 = INT_MIN;
+       viewX = x;
+       viewY = y;
+       // the overlay does not scroll, so with it in use everything is composited
+       if (overlayUsed || abs(dx) >= w || abs(dy) >= h)
+       {
+           invalidate();
+           return;
+       }
+       int n = w - abs(dx);
+       int from = (std::max)(dx, 0), to = (std::max)(-dx, 0);
+       if (dy >= 0)
+           for (int row = 0; row + dy < h; row++)
+               memmove(&pixels[size_t(row) * w + to], &pixels[size_t(row + dy) * w + from], n * sizeof(uint32_t));
+       else
+           for (int row = h - 1; row + dy >= 0; row--)
+               memmove(&pixels[size_t(row) * w + to], &pixels[size_t(row + dy) * w + from], n * sizeof(uint32_t));
+
+       if (dx > 0) composite(w - dx, 0, w - 1, h - 1);
+       if (dx < 0) composite(0, 0, -dx - 1, h - 1);
+       if (dy > 0) composite(0, h - dy, w - 1, h - 1);
+       if (dy < 0) composite(0, 0, w - 1, -dy - 1);
+       shownX = shownY = 0;
+       shownX2 = w - 1;
+       shownY2 = h - 1;
+   }
+   int Graphics::getviewx() { return viewX; }
+   int Graphics::getviewy() { return viewY; }
+
+   void Graphics::setTileBudget(size_t bytes)
+   {
+       tileLimit = bytes;
+       evictTiles();
+   }
+
+   size_t Graphics::tileBytes()
+   {
+       size_t bytes = hotTiles * TILE * TILE * sizeof(uint32_t);
+       for (int l = 0; l < OVERLAY; l++)
+           for (auto & kv : tiles[l])
+               bytes += sizeof(Tile) + kv.second.packed.capacity() * sizeof(uint32_t);
+       return bytes;
+   }
+
+   void Graphics::invalidate()
+   {
+       markDirty(0, 0, sz.Width - 1, sz.Height - 1);
+   }
+
+   // Topmost non-transparent layer wins. Works through the window rectangle
+   // tile by tile; tiles never drawn on are transparent, or black on the
+   // background layer.
+   void Graphics::composite(int x, int y, int x2, int y2)
+   {
+       if (x > x2 || y > y2) return;
+       beginFrame();
+       int w = sz.Width;
+       for (int wy = y + viewY; wy <= y2 + viewY; )
+       {
+           int ty = wy / TILE, rowEnd = (std::min)(y2 + viewY, ty * TILE + TILE - 1);
+           for (int wx = x + viewX; wx <= x2 + viewX; )
+           {
+               int tx = wx / TILE, colEnd = (std::min)(x2 + viewX, tx * TILE + TILE - 1);
+               const Tile * t[OVERLAY];
+               for (int l = 0; l < OVERLAY; l++)
+                   t[l] = wx < canvasW && wy < canvasH ? tile(l, tx, ty, false) : nullptr;
+               int n = colEnd - wx + 1;
+               for (int row = wy; row <= rowEnd; row++)
+               {
+                   size_t i = size_t(row - viewY) * w + (wx - viewX);
+                   size_t k = size_t(row % TILE) * TILE + wx % TILE;
+                   const uint32_t * over = &overlay[i];
+                   const uint32_t * shapes = t[SHAPES] ? &t[SHAPES]->pixels[k] : nullptr;
+                   const uint32_t * trails = t[TRAILS] ? &t[TRAILS]->pixels[k] : nullptr;
+                   const uint32_t * back = t[BACKGROUND] ? &t[BACKGROUND]->pixels[k] : nullptr;
+                   uint32_t * dst = &pixels[i];
+                   for (int j = 0; j < n; j++)
+                   {
+                       uint32_t px = over[j];
+                       if (!px && shapes) px = shapes[j];
+                       if (!px && trails) px = trails[j];
+                       if (!px) px = back ? back[j] : 0xFF000000u;
+                       dst[j] = px;
+                   }
+               }
+               wx = colEnd + 1;
+           }
+           wy = rowEnd + 1;
+       }
+       shownX = (std::min)(shownX, x);
+       shownY = (std::min)(shownY, y);
+       shownX2 = (std::max)(shownX2, x2);
+       shownY2 = (std::max)(shownY2, y2);
+   }
+
+   void Graphics::flush()
+   {
+       termOut.clear();
+       if (dirtyX <= dirtyX2) composite(dirtyX, dirtyY, dirtyX2, dirtyY2);
+       dirtyX = dirtyY = INT_MAX;
+       dirtyX2 = dirtyY2 = INT_MIN;
+       if (shownX > shownX2) return;
+       if (shared)
+       {
+           shared->dirtyX = shownX;
+           shared->dirtyY = shownY;
+           shared->dirtyX2 = shownX2;
+           shared->dirtyY2 = shownY2;
+           shared->seq.store((shared->seq.load(std::memory_order_relaxed) | 1) + 1, std::memory_order_release);
+       }
+       if (term != TERM_OFF)
+           presentTerminal(shownX, shownY, shownX2, shownY2);
+#ifdef _WIN32
+       else
+       {
+           Gdiplus::Bitmap bmp(sz.Width, sz.Height, sz.Width * sizeof(uint32_t),
+                               PixelFormat32bppRGB, reinterpret_cast<BYTE *>(pixels));
+           gr->DrawImage(&bmp, shownX, shownY, shownX, shownY,
+                         shownX2 - shownX + 1, shownY2 - shownY + 1, Gdiplus::UnitPixel);
+       }
+#endif
+       shownX = shownY = INT_MAX;
+       shownX2 = shownY2 = INT_MIN;
+       frames++;
+       evictTiles();
+   }
+
+   void Graphics::setterminal(Terminal mode, int columns, int lines)
+   {
+       term = mode;
+       termCols = columns;
+       termRows = lines;
+       if (term == TERM_OFF)
+       {
+           cells.clear();
+           invalidate();
+           return;
+       }
+#ifdef _WIN32
+       // the console takes ANSI sequences once asked to
+       HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+       DWORD consoleMode;
+       if (GetConsoleMode(out, &consoleMode))
+           SetConsoleMode(out, consoleMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+       CONSOLE_SCREEN_BUFFER_INFO csbi;
+       if ((columns <= 0 || lines <= 0) && GetConsoleScreenBufferInfo(out, &csbi))
+       {
+           columns = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+           lines = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+       }
+#else
+       winsize ws;
+       if ((columns <= 0 || lines <= 0) && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+       {
+           columns = ws.ws_col;
+           lines = ws.ws_row;
+       }
+#endif
+       cols = columns > 0 ? columns : 80;
+       lines = lines > 0 ? lines : 24;
+       top = lines > 1 ? 1 : 0;
+       rows = lines - top;
+       redrawterminal();
+   }
+
+   size_t Graphics::terminalBytes() { return termOut.size(); }
+
+   void Graphics::redrawterminal()
+   {
+       if (term == TERM_OFF) return;
+       cells.assign(size_t(cols) * rows, Cell{ 0, 0, 0 });
+       invalidate();
+   }
+
+   // ANSI colour of a pixel: red, green and blue each either on or off
+   static int ansi(uint32_t p)
+   {
+       return ((p >> 16) & 0xFF ? 1 : 0) | ((p >> 8) & 0xFF ? 2 : 0) | (p & 0xFF ? 4 : 0);
+   }
+
+   // Most frequent colour other than black, or black if there is no other
+   static int dominant(const int count[8])
+   {
+       int best = 0;
+       for (int i = 1; i < 8; i++)
+           if (count[i] && (best == 0 || count[i] > count[best])) best = i;
+       return best;
+   }
+
+   // Cell (cx, cy) of the terminal for the current frame. Half blocks split
+   // it into two pixel blocks one above the other, braille into 2 x 4 dots
+   // that are lit where their block is not black.
+   Graphics::Cell Graphics::cell(int cx, int cy)
+   {
+       static const uint8_t dotBits[8] = { 0x01, 0x08, 0x02, 0x10, 0x04, 0x20, 0x40, 0x80 };
+       int across = term == TERM_BRAILLE ? 2 : 1, down = term == TERM_BRAILLE ? 4 : 2;
+       int gw = cols * across, gh = rows * down;
+       int total[8] = {}, colour[8];
+       for (int sy = 0; sy < down; sy++)
+           for (int sx = 0; sx < across; sx++)
+           {
+               int gx = cx * across + sx, gy = cy * down + sy;
+               int x = gx * sz.Width / gw, y = gy * sz.Height / gh;
+               int x2 = (std::min)((std::max)((gx + 1) * sz.Width / gw, x + 1), int(sz.Width));
+               int y2 = (std::min)((std::max)((gy + 1) * sz.Height / gh, y + 1), int(sz.Height));
+               int count[8] = {};
+               for (int py = y; py < y2; py++)
+                   for (int px = x; px < x2; px++)
+                       count[ansi(pixels[size_t(py) * sz.Width + px])]++;
+               for (int i = 0; i < 8; i++)
+                   total[i] += count[i];
+               colour[sy * across + sx] = dominant(count);
+           }
+
+       if (term == TERM_BLOCKS)
+       {
+           if (colour[0] == colour[1]) return Cell{ ' ', uint8_t(colour[0]), uint8_t(colour[0]) };
+           return Cell{ 0x2580, uint8_t(colour[0]), uint8_t(colour[1]) };
+       }
+       int dots = 0;
+       for (int i = 0; i < 8; i++)
+           if (colour[i]) dots |= dotBits[i];
+       if (dots == 0) return Cell{ ' ', 0, 0 };
+       return Cell{ uint32_t(0x2800 + dots), uint8_t(dominant(total)), 0 };
+   }
+
+   // Sends the cells over the window area that differ from what the terminal
+   // shows, moving the cursor and switching colours only where needed, so the
+   // bytes of a frame follow the size of the change. The cursor of the text
+   // output is saved around it.
+   void Graphics::presentTerminal(int x, int y, int x2, int y2)
+   {
+       // cells and pixels round differently, so take a cell more on every side
+       int cx = (std::max)(x * cols / sz.Width - 1, 0);
+       int cy = (std::max)(y * rows / sz.Height - 1, 0);
+       int cx2 = (std::min)(x2 * cols / sz.Width + 1, cols - 1);
+       int cy2 = (std::min)(y2 * rows / sz.Height + 1, rows - 1);
+       int atX = -1, atY = -1, fg = -1, bg = -1;
+       char esc[32];
+       for (int r = cy; r <= cy2; r++)
+           for (int c = cx; c <= cx2; c++)
+           {
+               Cell now = cell(c, r);
+               Cell & was = cells[size_t(r) * cols + c];
+               if (now == was) continue;
+               was = now;
+               if (termOut.empty()) termOut += "\x1b" "7";
+               if (c != atX || r != atY)
+               {
+                   snprintf(esc, sizeof esc, "\x1b[%d;%dH", top + r + 1, c + 1);
+                   termOut += esc;
+               }
+               // a blank shows its background only
+               if (now.bg != bg || (now.glyph != ' ' && now.fg != fg))
+               {
+                   snprintf(esc, sizeof esc, "\x1b[%d;%dm", 30 + now.fg, 40 + now.bg);
+                   termOut += esc;
+                   fg = now.fg;
+                   bg = now.bg;
+               }
+               // UTF-8; the glyphs are a space or take three bytes
+               if (now.glyph < 0x80)
+                   termOut += char(now.glyph);
+               else
+               {
+                   termOut += char(0xE0 | (now.glyph >> 12));
+                   termOut += char(0x80 | ((now.glyph >> 6) & 0x3F));
+                   termOut += char(0x80 | (now.glyph & 0x3F));
+               }
+               atX = c + 1;
+               atY = r;
+           }
+       if (termOut.empty()) return;
+       termOut += "\x1b[0m\x1b" "8";
+       fwrite(termOut.data(), 1, termOut.size(), stdout);
+       fflush(stdout);
+   }
+
+   // Marks the shared frame as being written until the next flush()
+   void Graphics::beginFrame()
+   {
+       if (!shared) return;
+       uint64_t seq = shared->seq.load(std::memory_order_relaxed);
+       if (seq & 1) return;
+       shared->seq.store(seq + 1, std::memory_order_relaxed);
+       std::atomic_thread_fence(std::memory_order_release);
+   }
+
+   bool Graphics::share(const char * name)
+   {
+       unshare();
+       sharedName = name;
+       if (mapShared()) return true;
+       sharedName.clear();
+       return false;
+   }
+
+   void Graphics::unshare()
+   {
+       if (!shared) return;
+       retireShared();
+       sharedName.clear();
+   }
+
+   // Creates the segment for the current window size and moves the frame into it
+   bool Graphics::mapShared()
+   {
+       size_t offset = 64;
+       size_t bytes = offset + size_t(sz.Width) * sz.Height * sizeof(uint32_t);
+       void * view;
+#ifdef _WIN32
+       mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                    DWORD(uint64_t(bytes) >> 32), DWORD(bytes), sharedName.c_str());
+       if (mapping == NULL) return false;
+       view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+       if (view == NULL)
+       {
+           CloseHandle(mapping);
+           return false;
+       }
+#else
+       int fd = shm_open(sharedName.c_str(), O_CREAT | O_RDWR, 0644);
+       if (fd < 0) return false;
+       if (ftruncate(fd, off_t(bytes)) != 0)
+       {
+           close(fd);
+           return false;
+       }
+       view = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+       close(fd);
+       if (view == MAP_FAILED) return false;
+#endif
+       shared = static_cast<FrameHeader *>(view);
+       shared->seq.store(1, std::memory_order_relaxed);
+       std::atomic_thread_fence(std::memory_order_release);
+       shared->magic = FRAME_MAGIC;
+       shared->format = FRAME_XRGB32;
+       shared->width = sz.Width;
+       shared->height = sz.Height;
+       shared->stride = sz.Width * sizeof(uint32_t);
+       shared->offset = uint32_t(offset);
+       shared->size = bytes;
+       pixels = reinterpret_cast<uint32_t *>(static_cast<char *>(view) + offset);
+       memcpy(pixels, frame.data(), frame.size() * sizeof(uint32_t));
+       std::vector<uint32_t>().swap(frame);
+       // published by the next flush()
+       invalidate();
+       return true;
+   }
+
+   // Moves the frame back into private memory and releases the segment.
+   // Readers still mapping it see the magic cleared; a new segment may
+   // already exist under the same name.
+   void Graphics::retireShared()
+   {
+       frame.assign(pixels, pixels + size_t(sz.Width) * sz.Height);
+       shared->magic = 0;
+       shared->seq.store(shared->seq.load(std::memory_order_relaxed) | 1, std::memory_order_release);
+#ifdef _WIN32
+       UnmapViewOfFile(shared);
+       CloseHandle(mapping);
+#else
+       munmap(shared, size_t(shared->size));
+       shm_unlink(sharedName.c_str());
+#endif
+       shared = nullptr;
+       pixels = frame.data();
+   }
+
+   void Graphics::beginSprite(int x, int y)
+   {
+       capturing = true;
+       captureX = x;
+       captureY = y;
+       captured.clear();
+   }
+
+   Sprite Graphics::endSprite()
+   {
+       capturing = false;
+       Sprite s;
+       if (captured.empty()) return s;
+       int x = INT_MAX, y = INT_MAX, x2 = INT_MIN, y2 = INT_MIN;
+       for (const Span & sp : captured)
+       {
+           x = (std::min)(x, sp.x);   x2 = (std::max)(x2, sp.x2);
+           y = (std::min)(y, sp.y);   y2 = (std::max)(y2, sp.y);
+       }
+       s.ox = x;
+       s.oy = y;
+       s.width = x2 - x + 1;
+       s.height = y2 - y + 1;
+       s.pixels.assign(size_t(s.width) * s.height, 0);
+       for (const Span & sp : captured)
+       {
+           uint32_t * row = s.pixels.data() + size_t(sp.y - y) * s.width;
+           std::fill(row + sp.x - x, row + sp.x2 - x + 1, sp.c);
+       }
+       captured.clear();
+       return s;
+   }
+
+   void Graphics::blit(const Sprite & s, int x, int y)
+   {
+       int left = x + s.ox, top = y + s.oy;
+       for (int row = 0; row < s.height; row++)
+       {
+           const uint32_t * line = &s.pixels[size_t(row) * s.width];
+           pieces(left, left + s.width - 1, top + row, true, [line, left](uint32_t * dst, int from, int n) {
+               const uint32_t * src = line + (from - left);
+               for (int i = 0; i < n; i++)
+                   if (src[i] >> 24) dst[i] = src[i];
+           });
+       }
+       if (layer == OVERLAY) markDirty(left, top, left + s.width - 1, top + s.height - 1);
+       else markDirty(left - viewX, top - viewY, left + s.width - 1 - viewX, top + s.height - 1 - viewY);
+   }
+
+   void Graphics::stamp(const Sprite & s, int x, int y)
+   {
+       uint32_t ink = layer == BACKGROUND ? (color | 0xFF000000u) : color;
+       bool blank = ink == (layer == BACKGROUND ? 0xFF000000u : 0u);
+       int left = x + s.ox, top = y + s.oy;
+       for (int row = 0; row < s.height; row++)
+       {
+           const uint32_t * line = &s.pixels[size_t(row) * s.width];
+           pieces(left, left + s.width - 1, top + row, !blank, [line, left, ink](uint32_t * dst, int from, int n) {
+               const uint32_t * src = line + (from - left);
+               for (int i = 0; i < n; i++)
+                   if (src[i] >> 24) dst[i] = ink;
+           });
+       }
+       if (layer == OVERLAY) markDirty(left, top, left + s.width - 1, top + s.height - 1);
+       else markDirty(left - viewX, top - viewY, left + s.width - 1 - viewX, top + s.height - 1 - viewY);
+   }
+
+   SpriteCache::SpriteCache(size_t budget) : limit(budget), used(0) {}
+
+   void SpriteCache::setBudget(size_t bytes)
+   {
+       limit = bytes;
+       evict();
+   }
+
+   // Drops least recently used sprites until the budget is met; the most
+   // recent one is always kept so an oversized sprite can still be drawn
+   void SpriteCache::evict()
+   {
+       while (used > limit && lru.size() > 1)
+       {
+           used -= lru.back().sprite.bytes();
+           index.erase(lru.back().owner);
+           lru.pop_back();
+       }
+   }
+
+   const Sprite * SpriteCache::find(const void * owner)
+   {
+       auto it = index.find(owner);
+       if (it == index.end()) return nullptr;
+       lru.splice(lru.begin(), lru, it->second);
+       return &it->second->sprite;
+   }
+
+   const Sprite & SpriteCache::insert(const void * owner, Sprite && sprite)
+   {
+       erase(owner);
+       used += sprite.bytes();
+       lru.push_front({ owner, std::move(sprite) });
+       index[owner] = lru.begin();
+       evict();
+       return lru.front().sprite;
+   }
+
+   void SpriteCache::erase(const void * owner)
+   {
+       auto it = index.find(owner);
+       if (it == index.end()) return;
+       used -= it->second->sprite.bytes();
+       lru.erase(it->second);
+       index.erase(it);
+   }
+
+   void SpriteCache::clear()
+   {
+       lru.clear();
+       index.clear();
+       used = 0;
+   }
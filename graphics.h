@@ -5,29 +5,213 @@
 #define _GRAPHICS_
 #define _USE_MATH_DEFINES
 
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include <limits>
+#include <climits>
+#include <algorithm>
 #include <math.h>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <coroutine>
 #include <vector>
+#include <list>
+#include <utility>
+#include <deque>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#ifdef _WIN32
 #include <conio.h>
 #include <objidl.h>
 #include <gdiplus.h>
+#else
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#endif
 
 namespace Grfx
 {
 
+// Persistent drawing layers, composited bottom to top. All but the
+// overlay are in canvas coordinates and scroll with the view.
+enum Layer
+{
+   BACKGROUND,
+   TRAILS,
+   SHAPES,
+   OVERLAY,       // menu and status backdrops, in window coordinates
+   LAYERS
+};
+
+// Colour index that clears pixels of the current layer
+const int ERASE = -1;
+
+// How Graphics::setterminal() draws into a text terminal
+enum Terminal
+{
+   TERM_OFF,      // frames go to the console window
+   TERM_BLOCKS,   // two pixels per cell with the upper half block
+   TERM_BRAILLE,  // 2x4 dots per cell in a single colour
+};
+
+// Vertex of the batch primitives, passed as contiguous arrays
+struct Point
+{
+   int x, y;
+};
+
+// Start of a framebuffer shared with other processes by Graphics::share().
+// The pixels follow at offset; the writer never waits for readers, so a
+// reader checks that seq is even and unchanged around its read of a frame.
+// The magic is cleared when the segment is given up, e.g. on a window
+// resize; the reader then opens the name again.
+struct FrameHeader
+{
+   uint32_t magic;            // FRAME_MAGIC
+   uint32_t format;           // FRAME_XRGB32
+   uint32_t width, height;    // pixels
+   uint32_t stride;           // bytes per row, top row first
+   uint32_t offset;           // bytes from the header to the first pixel
+   uint64_t size;             // bytes of the whole segment
+   std::atomic<uint64_t> seq; // odd while a frame is being written
+   int32_t dirtyX, dirtyY, dirtyX2, dirtyY2;   // changed by the last frame, inclusive
+};
+
+static_assert(sizeof(FrameHeader) <= 64, "pixels start at offset 64");
+
+const uint32_t FRAME_MAGIC = 0x58465247;   // "GRFX"
+const uint32_t FRAME_XRGB32 = 1;           // 32 bits per pixel, blue in the lowest byte
+
+// Rasterized image of a shape, positioned relative to an anchor point
+struct Sprite
+{
+   int ox = 0, oy = 0;            // top-left pixel relative to the anchor
+   int width = 0, height = 0;
+   std::vector<uint32_t> pixels;  // ARGB, alpha 0 = transparent
+
+   size_t bytes() const { return sizeof(Sprite) + pixels.size() * sizeof(uint32_t); }
+};
+
+// LRU cache of sprites keyed by their owner with a global memory budget
+class SpriteCache
+{
+   struct Entry
+   {
+      const void * owner;
+      Sprite sprite;
+   };
+   std::list<Entry> lru;          // most recently used first
+   std::unordered_map<const void *, std::list<Entry>::iterator> index;
+   size_t limit;
+   size_t used;
+
+   void evict();
+public:
+
+   explicit SpriteCache(size_t budget = 8 * 1024 * 1024);
+   void setBudget(size_t bytes);
+   size_t budget() const { return limit; }
+   size_t size() const { return used; }
+   const Sprite * find(const void * owner);
+   const Sprite & insert(const void * owner, Sprite && sprite);
+   void erase(const void * owner);
+   void clear();
+
+}; // class SpriteCache
+
 class Graphics
 {
+   struct Span
+   {
+      int x, x2, y;
+      uint32_t c;
+   };
+
+   // Square piece of a canvas layer, allocated when first drawn on
+   static const int TILE = 64;
+   struct Tile
+   {
+      std::vector<uint32_t> pixels;   // TILE * TILE, empty while packed
+      std::vector<uint32_t> packed;   // (run length, pixel) pairs of a cold tile
+      uint64_t used;                  // flush() count at the last access
+   };
+
+   // Character cell of the terminal, see setterminal()
+   struct Cell
+   {
+      uint32_t glyph;                 // code point, 0 while unknown
+      uint8_t fg, bg;                 // ANSI colours 0-7
+      bool operator==(const Cell & c) const { return glyph == c.glyph && fg == c.fg && bg == c.bg; }
+   };
+
+#ifdef _WIN32
    HWND hWnd;
    HDC hDC;
-   Gdiplus::Color color;
    Gdiplus::Graphics * gr;
    ULONG_PTR           gdiplusToken;
    Gdiplus::Size	sz;
+#else
+   struct { int Width, Height; } sz;
+#endif
+   uint32_t color;
+   // everything is rasterized into the layers; flush() composites the
+   // changed rectangle into frame and presents it
+   Layer layer;
+   std::unordered_map<uint64_t, Tile> tiles[OVERLAY];
+   Tile * recent[OVERLAY];             // last tile looked up per layer
+   uint64_t recentKey[OVERLAY];
+   std::vector<uint32_t> overlay;
+   bool overlayUsed;
+   std::vector<uint32_t> frame;
+   uint32_t * pixels;                  // frame, or the shared segment's pixels
+   FrameHeader * shared;
+   std::string sharedName;
+#ifdef _WIN32
+   HANDLE mapping;
+#endif
+   int canvasW, canvasH;
+   int viewX, viewY;                   // canvas pixel at the window's top-left corner
+   uint64_t frames;
+   size_t hotTiles, tileLimit;         // unpacked tiles and their budget
+   int dirtyX, dirtyY, dirtyX2, dirtyY2;   // window area to composite
+   int shownX, shownY, shownX2, shownY2;   // window area to present
+   // sprite recording, see beginSprite()
+   bool capturing;
+   int captureX, captureY;
+   std::vector<Span> captured;
+   // terminal output: the cells it shows and the sequences of one frame
+   Terminal term;
+   int termCols, termRows;             // as given to setterminal(), 0 = the terminal's
+   int cols, rows;                     // cells of the picture
+   int top;                            // rows above it, left to text
+   std::vector<Cell> cells;
+   std::string termOut;
+
+   Tile * tile(int l, int tx, int ty, bool create);
+   void pack(Tile & t);
+   void unpack(Tile & t);
+   void evictTiles();
+   template <class F> void pieces(int x, int x2, int y, bool create, F f);
+   void plot(int x, int y);
+   void span(int x, int x2, int y);
+   void markDirty(int x, int y, int x2, int y2);
+   void composite(int x, int y, int x2, int y2);
+   bool mapShared();
+   void retireShared();
+   void beginFrame();
+   Cell cell(int cx, int cy);
+   void presentTerminal(int x, int y, int x2, int y2);
 public:
 
    Graphics();
@@ -36,12 +220,59 @@ public:
    void line(int x, int y, int x2, int y2);
    void circle(int x, int y, int r);
    void rectangle(int x, int y, int x2, int y2);
+   void bar(int x, int y, int x2, int y2);
+   void polyline(const Point * pts, int n);
+   // closed outline
+   void polygon(const Point * pts, int n);
+   // even-odd scanline fill
+   void fillpolygon(const Point * pts, int n);
+   // square dots of the given size with their top-left corner at each point
+   void points(const Point * pts, int n, int dot = 1);
+   // selects the layer the following drawing goes to
+   void setlayer(Layer l);
+   void clear(Layer l);
    // 2017-04-01 11:50 alkhizha
    void cls();
    // 2017-04-01 11:50 alkhizha
    void windowSize();
    int hSize();
    int vSize();
+   // canvas the shapes live on; drawing outside it is clipped
+   void setcanvas(int w, int h);
+   int canvasWidth();
+   int canvasHeight();
+   // pans the window over the canvas; only the uncovered part is composited
+   void setview(int x, int y);
+   int getviewx();
+   int getviewy();
+   // memory for unpacked tiles; the least recently used beyond it are packed
+   void setTileBudget(size_t bytes);
+   size_t tileBytes();
+   // composites into a named shared memory segment, see FrameHeader, that
+   // viewers map to read frames without copies; false if it cannot be created
+   bool share(const char * name);
+   void unshare();
+   // presents frames as text in the terminal on stdout instead of the window:
+   // each cell stands for a block of pixels, and flush() sends ANSI sequences
+   // for the cells that changed only. The top line stays free for prompts.
+   // columns or lines of 0 take the terminal's size
+   void setterminal(Terminal mode, int columns = 0, int lines = 0);
+   // bytes sent to the terminal by the last flush()
+   size_t terminalBytes();
+   // forgets what the terminal shows, e.g. after text was written over the
+   // picture or the screen was cleared; the next flush() sends every cell
+   void redrawterminal();
+   // presents the pixels changed since the previous flush()
+   void flush();
+   // forces the next flush() to repaint the whole window
+   void invalidate();
+   // drawing between beginSprite() and endSprite() is recorded
+   // into a sprite anchored at (x, y) instead of reaching the screen
+   void beginSprite(int x, int y);
+   Sprite endSprite();
+   void blit(const Sprite & s, int x, int y);
+   // draws the opaque pixels of a sprite in the current colour
+   void stamp(const Sprite & s, int x, int y);
 
 }; // class Graphics
 